@@ -11,6 +11,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <strings.h>
 #include <errno.h>
@@ -18,6 +19,9 @@
 #include <signal.h>
 #include <math.h>
 #include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/types.h>
@@ -26,17 +30,447 @@
 #include <sys/types.h>
 #include <netdb.h> 
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
 #include <netinet/tcp.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include <endian.h>
+#include "timing.h"
+#include "hist.h"
 
 #define BUF_SIZE 102400		// Make sure it's larger than the MTU
-#define SERIES 10			// Number of iterations per size
+#define SERIES 10			// Default number of iterations per size
+#define MAX_CLIENTS 16		// Default number of concurrent server sessions
+#define CHUNK_SIZE (256L*1024L)	// Per-session relay buffer (server) and send/recv chunk (client)
+#define STALL_MS 10			// Relay stall after which the server falls back to blocking sends (relay_blocking)
+#define STALL_TIMEOUT_MS 10000	// Give up a client that does not read its echo for this long
+#define HUGE_PAGE_SIZE (2L*1024L*1024L)
+#define PROTO_VERSION 2		// Highest protocol version we speak
+#define PROTO_MAGIC "BWPROTO"	// Handshake, followed by the version digit
+#define FRAME_SIZE 48		// Size of an encoded v2 frame header
+#define TIMED_SIZE (1024L*1024L)	// Default message size of duration based tests
+#define MAX_DEPTH 256		// Deepest pipeline of the --depth sweep
+#define MAX_PROBES 100000	// Most probes of the one-way delay estimation
 
 static volatile int sock = 0;
 static volatile size_t bytes_total;		// Bytes counter
 static int warmup_s = 0;				// Warmup seconds
+static bool busy_poll = false;			// Spin on non-blocking receives instead of sleeping
+static int pin_cpu = -1;				// Pin the data path to this cpu (-1 = no pinning)
+static int max_clients = MAX_CLIENTS;	// Server worker pool size and concurrent session limit
+static bool lock_buffers = false;		// mlock the transfer buffers
+static long test_size = 0;				// Run only this message size instead of the size table (0 = table)
+static int proto_request = PROTO_VERSION;	// Client: Protocol version to request
+static int streams = 1;					// Client: Number of parallel streams (connections)
+
+typedef enum {
+	MODE_ECHO,				// Send and wait for the echo (half-duplex)
+	MODE_SEND,				// Send only, the server discards
+	MODE_REVERSE,			// Receive only, the server sends
+	MODE_DUPLEX,			// Send and receive at the same time on separate connections
+} test_mode_t;
+static test_mode_t mode = MODE_ECHO;	// Client: Test mode
+static double duration_s = 0;			// Client: Run for this many seconds instead of the size table (0 = table)
+static double interval_s = 1;			// Client: Report interval of duration based tests
+static bool timed_running = false;		// Client: Duration based test is running (atomic)
+static double udp_rate = 0;				// Client: Target rate of the udp test in bits/s (0 = tcp tests)
+static int udp_size = 1400;				// Client: Udp payload size
+static double open_rate = 0;			// Client: Requests/s of the open-loop latency test (0 = off)
+static int load_connections = 0;		// Client: Connections of the load test (0 = off)
+static double load_ramp = 1000;			// Client: New connections per second of the load test
+static int keepalive_ms = 1000;			// Client: Keepalive interval of the load test connections
+static int depth = 0;					// Client: Requests in flight of the pipelined ping test (0 = off, -1 = sweep)
+static bool zerocopy = false;			// Send with MSG_ZEROCOPY (client and server)
+static bool zerocopy_compare = false;	// Client: Compare copying and zerocopy sends
+static int metrics_port = 0;			// Client: echod metrics port to read the server memory from (0 = STATS)
+static __thread char *client_buf = NULL;	// Client: Send and receive buffer of this stream (see buf_alloc)
+static __thread int proto = 1;			// Client: Negotiated protocol version of this stream
+static __thread uint64_t seq = 0;		// Client: Sequence number of the last v2 request of this stream
+static long bytes_table[] = {128L,256L,512L,1024L,2048L,4096L,10240L,40960L,81920L,122880L,163840L,204800L,327680L,409600L,819200L,1228800L,1638400L, 3276800L, 4915200L, 6553600L, 65536000L};
+static int owd_probes = 100;			// Client: Probes for the one-way delay estimation (0 = disabled)
+static int owd_interval_ms = 10;		// Client: Delay between two one-way delay probes
+static int iterations = SERIES;			// Client: Messages per size (and pings)
+static bool sw_timestamps = false;		// Client: Split the ping into host stack and wire time (SO_TIMESTAMPING)
 
 int run_server(const int port);
 int run_client(const char* remote, const int port);
+int run_parallel(const char* remote, const int port);
+int run_timed(const char* remote, const int port);
+int run_udp(const char* remote, const int port);
+int run_open_loop(const char* remote, const int port);
+int run_load(const char* remote, const int port);
+int run_depth(const char* remote, const int port);
+int run_zerocopy(const char* remote, const int port);
+int run_sweep(const char* remote, const int port);
+
+/** Receive exactly len bytes (unless the peer closes). In busy-poll mode we spin on
+  * non-blocking receives instead of sleeping in the kernel until the data arrives */
+static ssize_t recv_all(const int sock, void *buf, const size_t len) {
+	if(!busy_poll) return recv(sock, buf, len, MSG_WAITALL);
+	size_t received = 0;
+	while(received < len) {
+		ssize_t rc = recv(sock, (char*)buf + received, len - received, MSG_DONTWAIT);
+		if(rc < 0) {
+			// Yield is nearly free if nothing else is runnable, but keeps an oversubscribed cpu usable
+			if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) { sched_yield(); continue; }
+			return (received > 0) ? (ssize_t)received : -1;
+		} else if(rc == 0) break;
+		received += (size_t)rc;
+	}
+	return (ssize_t)received;
+}
+
+/** Send all len bytes, blocking until they are queued
+  * @returns number of bytes sent or -1 on error */
+static ssize_t send_all(const int sock, const void *buf, const size_t len) {
+	size_t sent = 0;
+	while(sent < len) {
+		ssize_t rc = send(sock, (const char*)buf + sent, len - sent, MSG_NOSIGNAL);
+		if(rc < 0) {
+			if(errno == EINTR) continue;
+			return -1;
+		}
+		sent += (size_t)rc;
+	}
+	return (ssize_t)sent;
+}
+
+/** Parse a message size with an optional binary K, M or G suffix (e.g. "4G")
+  * @returns size in bytes or -1 if the string is not a valid size */
+static long parse_size(const char* str) {
+	char *end;
+	long size = strtol(str, &end, 10);
+	if(end == str || size < 0) return -1;
+	switch(*end) {
+		case 'K': case 'k': size <<= 10; end++; break;
+		case 'M': case 'm': size <<= 20; end++; break;
+		case 'G': case 'g': size <<= 30; end++; break;
+	}
+	while(*end == ' ') end++;
+	return (*end == '\0') ? size : -1;
+}
+
+/** Parse a rate (bits/s or requests/s) with an optional decimal K, M or G suffix (e.g. "2.5G")
+  * @returns rate or -1 if the string is not a valid rate */
+static double parse_rate(const char* str) {
+	char *end;
+	double rate = strtod(str, &end);
+	if(end == str || rate < 0) return -1;
+	switch(*end) {
+		case 'K': case 'k': rate *= 1e3; end++; break;
+		case 'M': case 'm': rate *= 1e6; end++; break;
+		case 'G': case 'g': rate *= 1e9; end++; break;
+	}
+	return (*end == '\0') ? rate : -1;
+}
+
+/** Format a message size into the 8 byte size header, using a K, M or G suffix for sizes that
+  * do not fit into 8 digits
+  * @returns 0 on success, -1 if the size cannot be expressed in 8 bytes */
+static int format_size(char* msg, const long size) {
+	const char *units = "KMG";
+	if(size < 0) return -1;
+	if(size < 100000000L) {
+		snprintf(msg, 9, "%ld", size);
+		return 0;
+	}
+	for(int i=2;i>=0;i--) {
+		const long unit = 1L << (10*(i+1));
+		if(size % unit == 0 && size / unit < 10000000L) {
+			snprintf(msg, 9, "%ld%c", size / unit, units[i]);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/** Mapped length of a buffer of the given size: Whole huge pages from HUGE_PAGE_SIZE on, whole
+  * pages below, so that small buffers do not pin a huge page each */
+static size_t buf_len(const size_t size) {
+	const size_t align = (size >= (size_t)HUGE_PAGE_SIZE) ? (size_t)HUGE_PAGE_SIZE : (size_t)sysconf(_SC_PAGESIZE);
+	return (size + align - 1) & ~(align - 1);
+}
+
+/** Allocate a transfer buffer that is reused for the whole run. Buffers of at least HUGE_PAGE_SIZE
+  * are backed by huge pages if possible (MAP_HUGETLB, otherwise transparent huge pages). The buffer
+  * is pre-faulted and with --mlock locked in memory, so that no page faults or zeroing happen while
+  * we are measuring
+  * @param size Requested size, rounded up to the (huge) page size
+  * @returns buffer or NULL on error */
+static void* buf_alloc(const size_t size) {
+	static bool warned = false;
+	const size_t len = buf_len(size);
+	void *buf = MAP_FAILED;
+	if(len >= (size_t)HUGE_PAGE_SIZE)
+		buf = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if(buf == MAP_FAILED) {
+		buf = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(buf == MAP_FAILED) return NULL;
+		if(len >= (size_t)HUGE_PAGE_SIZE) madvise(buf, len, MADV_HUGEPAGE);
+	}
+	if(lock_buffers && mlock(buf, len) < 0 && !warned) {
+		warned = true;		// Not worth a warning per buffer
+		fprintf(stderr, "Warning: Cannot lock transfer buffers in memory: %s\n", strerror(errno));
+	}
+	memset(buf, 'a', len);		// Pre-fault, mlock may be off or have failed
+	return buf;
+}
+
+/** Release a buffer allocated with buf_alloc */
+static void buf_free(void *buf, const size_t size) {
+	if(buf == NULL) return;
+	munmap(buf, buf_len(size));
+}
+
+/** Number of page faults (minor and major) of the calling thread so far */
+static long thread_faults() {
+	struct rusage usage;
+	if(getrusage(RUSAGE_THREAD, &usage) < 0) return 0;
+	return usage.ru_minflt + usage.ru_majflt;
+}
+
+/** Cpu time of the calling thread in ns */
+static uint64_t thread_cpu_ns() {
+	struct timespec ts;
+	if(clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) < 0) return 0;
+	return (uint64_t)ts.tv_sec * 1000000000UL + (uint64_t)ts.tv_nsec;
+}
+
+/** Milliseconds on the monotonic clock */
+static long now_ms() {
+	return (long)(time_ns() / 1000000UL);
+}
+
+/* Protocol v2: After the handshake (PROTO_MAGIC plus version digit in both directions)
+ * every message starts with a frame header, followed by len bytes of payload.
+ * Requests are answered with a frame carrying the same sequence number and the
+ * sender timestamp, the server adds its receive and transmit timestamps. */
+
+typedef enum {
+	FRAME_PING = 1,			// Latency probe, answered with PONG
+	FRAME_PONG = 2,
+	FRAME_DATA = 3,			// len bytes of payload, echoed back after a DATA reply header
+	FRAME_REVERSE = 4,		// Request len bytes from the server, sent after a REVERSE reply header
+	FRAME_STATS = 5,		// Request server statistics, answered with STATS and stats_t as payload
+	FRAME_CLOSE = 6,		// End of the session, no reply
+	FRAME_ERR = 7,			// Error reply (unknown or illegal request)
+	FRAME_UDP = 8,			// Start a udp test, answered with UDP and the udp port (64-bit) as payload
+	FRAME_UDP_END = 9,		// End of the udp test, answered with UDP_END and udp_result_t as payload
+	FRAME_SOCKOPT = 10,		// Socket options for the server end, sockopt_t values as payload, answered with SOCKOPT
+} frame_type_t;
+
+#define FRAME_FLAG_DISCARD 0x0001	// DATA: Do not echo, reply once the whole payload has been received
+
+typedef struct {
+	uint16_t type;			// frame_type_t
+	uint16_t flags;
+	uint32_t reserved;
+	uint64_t seq;			// Sequence number, copied into the reply
+	uint64_t len;			// Payload length
+	uint64_t ts;			// Sender timestamp (ns, CLOCK_REALTIME), copied into the reply
+	uint64_t ts_rx;			// Server: Time the request was received
+	uint64_t ts_tx;			// Server: Time the reply was sent
+} frame_t;
+
+/* Payload of a STATS reply: STATS_COUNT 64-bit values in network byte order.
+ * Clients must accept longer payloads, new values are only appended */
+typedef enum {
+	STAT_SESSIONS = 0,		// Currently active sessions
+	STAT_MAX_CLIENTS,		// Session limit
+	STAT_BYTES,				// Bytes echoed in this session
+	STAT_FAULTS,			// Page faults of this session
+	STAT_RSS,				// Resident memory of the server in bytes
+	STATS_COUNT
+} stat_t;
+
+/* Payload of a UDP_END reply, same encoding as STATS */
+typedef enum {
+	UDP_RECEIVED = 0,		// Received datagrams, including duplicates
+	UDP_BYTES,				// Received bytes (udp payload)
+	UDP_DUPLICATES,			// Datagrams received more than once
+	UDP_REORDERED,			// Datagrams that arrived after a datagram with a higher sequence number
+	UDP_REORDER_DEPTH,		// Largest distance to the highest sequence number seen before
+	UDP_JITTER,				// RFC 3550 interarrival jitter in ns
+	UDP_DURATION,			// Time between the first and the last datagram in ns
+	UDP_RESULTS
+} udp_result_t;
+
+/* Payload of a SOCKOPT request, same encoding as STATS. UINT64_MAX leaves an option untouched.
+ * The client keeps the current values in sockopts, the server per session */
+typedef enum {
+	SOCKOPT_SNDBUF = 0,		// SO_SNDBUF
+	SOCKOPT_RCVBUF,			// SO_RCVBUF
+	SOCKOPT_NODELAY,		// TCP_NODELAY (default: 1)
+	SOCKOPT_CORK,			// TCP_CORK, set around every message and cleared once it has been sent
+	SOCKOPT_QUICKACK,		// TCP_QUICKACK, re-armed for every message as the kernel clears it
+	SOCKOPT_LOWAT,			// TCP_NOTSENT_LOWAT
+	SOCKOPT_MAXSEG,			// TCP_MAXSEG, only has full effect before connect (client)
+	SOCKOPTS
+} sockopt_t;
+
+static const struct {
+	const char* name;		// Name for --sockopt and the reports
+	int level;
+	int optname;
+	bool size;				// Value is a size in bytes (formatted with K/M)
+} sockopt_defs[SOCKOPTS] = {
+	{ "sndbuf", SOL_SOCKET, SO_SNDBUF, true },
+	{ "rcvbuf", SOL_SOCKET, SO_RCVBUF, true },
+	{ "nodelay", IPPROTO_TCP, TCP_NODELAY, false },
+	{ "cork", IPPROTO_TCP, TCP_CORK, false },
+	{ "quickack", IPPROTO_TCP, TCP_QUICKACK, false },
+	{ "lowat", IPPROTO_TCP, TCP_NOTSENT_LOWAT, true },
+	{ "mss", IPPROTO_TCP, TCP_MAXSEG, false },
+};
+
+#define MAX_SWEEP_VALUES 16		// Values per option of the socket option sweep
+static long sweep_values[SOCKOPTS][MAX_SWEEP_VALUES];	// Client: Values of every option from --sockopt
+static int sweep_count[SOCKOPTS];		// Client: Number of values per option (0 = not given)
+static long sockopts[SOCKOPTS] = { -1, -1, -1, -1, -1, -1, -1 };	// Client: Current options (-1 = untouched)
+
+/* Every test datagram starts with its sequence number and the send time (ns) in network byte order */
+#define UDP_HEADER 16
+#define UDP_BATCH 64		// Datagrams per sendmmsg/recvmmsg
+#define UDP_MAX 65536		// Receive buffer per datagram
+#define UDP_DRAIN_MS 100	// After the end of a udp test, wait this long for late datagrams
+#define UDP_WINDOW (1UL << 20)	// Sequence numbers below the highest one that are checked for duplicates
+
+/** Current wall clock time in ns, used for the frame timestamps */
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000UL + (uint64_t)ts.tv_nsec;
+}
+
+/** Encode a frame header into FRAME_SIZE bytes in network byte order */
+static void frame_encode(const frame_t *frame, unsigned char *buf) {
+	const uint16_t type = htobe16(frame->type), flags = htobe16(frame->flags);
+	const uint32_t reserved = htobe32(frame->reserved);
+	const uint64_t fields[5] = { htobe64(frame->seq), htobe64(frame->len), htobe64(frame->ts), htobe64(frame->ts_rx), htobe64(frame->ts_tx) };
+	memcpy(buf, &type, 2);
+	memcpy(buf + 2, &flags, 2);
+	memcpy(buf + 4, &reserved, 4);
+	memcpy(buf + 8, fields, sizeof(fields));
+}
+
+/** Decode a frame header from FRAME_SIZE bytes in network byte order */
+static void frame_decode(frame_t *frame, const unsigned char *buf) {
+	uint16_t type, flags;
+	uint32_t reserved;
+	uint64_t fields[5];
+	memcpy(&type, buf, 2);
+	memcpy(&flags, buf + 2, 2);
+	memcpy(&reserved, buf + 4, 4);
+	memcpy(fields, buf + 8, sizeof(fields));
+	frame->type = be16toh(type);
+	frame->flags = be16toh(flags);
+	frame->reserved = be32toh(reserved);
+	frame->seq = be64toh(fields[0]);
+	frame->len = be64toh(fields[1]);
+	frame->ts = be64toh(fields[2]);
+	frame->ts_rx = be64toh(fields[3]);
+	frame->ts_tx = be64toh(fields[4]);
+}
+
+/** Send a frame header
+  * @returns 0 on success, -1 on error */
+static int send_frame(const int sock, const frame_t *frame) {
+	unsigned char buf[FRAME_SIZE];
+	frame_encode(frame, buf);
+	return (send_all(sock, buf, FRAME_SIZE) < 0) ? -1 : 0;
+}
+
+/** Receive a frame header
+  * @returns 1 on success, 0 if the peer closed the connection and -1 on error */
+static int recv_frame(const int sock, frame_t *frame) {
+	unsigned char buf[FRAME_SIZE];
+	ssize_t len = recv_all(sock, buf, FRAME_SIZE);
+	if(len < 0) return -1;
+	else if(len == 0) return 0;
+	else if(len < FRAME_SIZE) {
+		errno = EPROTO;
+		return -1;
+	}
+	frame_decode(frame, buf);
+	return 1;
+}
+
+/** Enable busy polling in the kernel for the given socket (best-effort, may require CAP_NET_ADMIN) */
+static void setup_busy_poll(const int sock) {
+	int usecs = 50;
+	if(setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) < 0)
+		fprintf(stderr, "Warning: Failed to set SO_BUSY_POLL: %s\n", strerror(errno));
+#ifdef SO_PREFER_BUSY_POLL
+	int one = 1;
+	if(setsockopt(sock, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof(one)) < 0)
+		fprintf(stderr, "Warning: Failed to set SO_PREFER_BUSY_POLL: %s\n", strerror(errno));
+#endif
+}
+
+/** Apply the given socket options (-1 = untouched). TCP_CORK is left to message_begin/message_end
+  * @returns 0 on success, -1 if an option has been refused */
+static int apply_sockopts(const int sock, const long *opts) {
+	for(int i=0;i<SOCKOPTS;i++) {
+		if(opts[i] < 0 || i == SOCKOPT_CORK) continue;
+		const int value = (int)opts[i];
+		if(setsockopt(sock, sockopt_defs[i].level, sockopt_defs[i].optname, &value, sizeof(value)) < 0) {
+			fprintf(stderr, "Cannot set %s=%d: %s\n", sockopt_defs[i].name, value, strerror(errno));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/** Per-message socket options, call before the first byte of a message is sent: Cork the socket
+  * and re-arm TCP_QUICKACK, which the kernel clears again on its own */
+static void message_begin(const int sock, const long *opts) {
+	if(opts[SOCKOPT_CORK] > 0) {
+		int one = 1;
+		setsockopt(sock, IPPROTO_TCP, TCP_CORK, &one, sizeof(one));
+	}
+	if(opts[SOCKOPT_QUICKACK] >= 0) {
+		int value = (int)opts[SOCKOPT_QUICKACK];
+		setsockopt(sock, IPPROTO_TCP, TCP_QUICKACK, &value, sizeof(value));
+	}
+}
+
+/** Per-message socket options, call once the whole message has been sent: Uncork to flush the
+  * last partial segment */
+static void message_end(const int sock, const long *opts) {
+	if(opts[SOCKOPT_CORK] > 0) {
+		int zero = 0;
+		setsockopt(sock, IPPROTO_TCP, TCP_CORK, &zero, sizeof(zero));
+	}
+}
+
+/** Format the value of a socket option, sizes with a K or M suffix where exact */
+static char* str_sockopt(char* buf, const size_t size, const int opt, const long value) {
+	if(value < 0) snprintf(buf, size, "%s=default", sockopt_defs[opt].name);
+	else if(sockopt_defs[opt].size && value > 0 && value % (1024L*1024L) == 0) snprintf(buf, size, "%s=%ldM", sockopt_defs[opt].name, value >> 20);
+	else if(sockopt_defs[opt].size && value > 0 && value % 1024L == 0) snprintf(buf, size, "%s=%ldK", sockopt_defs[opt].name, value >> 10);
+	else snprintf(buf, size, "%s=%ld", sockopt_defs[opt].name, value);
+	return buf;
+}
+
+/** Number of socket option combinations of the sweep (1 = no sweep) */
+static int sweep_configs() {
+	int configs = 1;
+	for(int i=0;i<SOCKOPTS;i++)
+		if(sweep_count[i] > 0) configs *= sweep_count[i];
+	return configs;
+}
+
+/** Pin the calling thread to the given cpu, if any (-1 = no pinning) */
+static void pin_thread(const int cpu) {
+	if(cpu < 0) return;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+		fprintf(stderr, "Warning: Cannot pin thread to cpu %d\n", cpu);
+}
 
 void cleanup() {
 	if(sock > 0)
@@ -46,6 +480,7 @@ void cleanup() {
 
 int main(int argc, char** argv) {
 	bool server = false;
+	bool tsc = false;
 	int port = 12998;
 	char* remote = "127.0.0.1";
 	
@@ -67,6 +502,48 @@ int main(int argc, char** argv) {
 				printf("  -h, --help                 Print this help message\n");
 				printf("  -s, --server               Run as server\n");
 				printf("      --warmup SECONDS       Run benchmark after a given warmup delay\n");
+				printf("      --mlock                Lock the transfer buffers in memory (client and server)\n");
+				printf("      --busy-poll            Spin on non-blocking receives (and SO_BUSY_POLL)\n");
+				printf("                             instead of sleeping, client and server\n");
+				printf("      --cpu N                Pin the client (or the server sessions) to cpu N\n");
+				printf("      --size N[K|M|G]        Only test messages of the given size\n");
+				printf("  -P N                       Run N parallel streams (connections), with --cpu C\n");
+				printf("                             stream i is pinned to cpu C+i\n");
+				printf("  -t SECONDS                 Run for the given time instead of the size table, with\n");
+				printf("                             messages of --size bytes (default: 1M)\n");
+				printf("  -i SECONDS                 Report interval for -t (default: 1)\n");
+				printf("  -u, --udp RATE[K|M|G]      Udp test: Send datagrams at RATE bits/s for -t seconds\n");
+				printf("                             (default: 10), the server reports loss, jitter and reordering\n");
+				printf("      --udp-size BYTES       Udp payload size (default: 1400)\n");
+				printf("      --depth N|sweep        Pipelined pings: Keep N requests in flight for -t seconds\n");
+				printf("                             (default: 1), sweep runs the depths 1, 2, 4 ... %d\n", MAX_DEPTH);
+				printf("      --sockopt NAME=V[,V...]  Set a socket option on both ends, with several values run the\n");
+				printf("                             size table for every combination of all given options and\n");
+				printf("                             report the best one per size. NAME is sndbuf, rcvbuf, nodelay,\n");
+				printf("                             cork, quickack, lowat (TCP_NOTSENT_LOWAT) or mss (TCP_MAXSEG),\n");
+				printf("                             V a value (with K or M suffix) or default\n");
+				printf("      --zerocopy             Send with MSG_ZEROCOPY (client and server)\n");
+				printf("      --zerocopy-compare     Compare throughput and sender cpu of copying and zerocopy\n");
+				printf("                             uploads for every size\n");
+				printf("      --connections N        Load test: Hold N mostly idle connections for -t seconds\n");
+				printf("                             (default: 10), works against bw and echod servers\n");
+				printf("      --ramp RATE            Load test: Open RATE connections per second (default: 1000)\n");
+				printf("      --keepalive MS         Load test: Ping every connection every MS ms (default: 1000)\n");
+				printf("      --metrics PORT         Load test: Read the server memory from the echod metrics port\n");
+				printf("      --rate RATE[K|M]       Open-loop latency test: Send pings at RATE requests/s for -t\n");
+				printf("                             seconds (default: 10), regardless of outstanding replies\n");
+				printf("      --mode MODE            echo (default), send (upload only), reverse (download\n");
+				printf("                             only) or duplex (upload and download at the same time)\n");
+				printf("      --legacy               Use the legacy ASCII protocol\n");
+				printf("      --tsc                  Take timestamps from the calibrated TSC (x86 with invariant\n");
+				printf("                             TSC) instead of CLOCK_MONOTONIC_RAW\n");
+				printf("      --probes N             Estimate one-way delays from N probes (default: 100, 0 = off)\n");
+				printf("      --probe-interval MS    Delay between two probes in ms (default: 10)\n");
+				printf("      --iterations N         Messages per size and pings (default: %d)\n", SERIES);
+				printf("      --timestamps           Split the ping into host stack and wire+remote time using\n");
+				printf("                             kernel software timestamps (SO_TIMESTAMPING)\n");
+				printf("      --max-clients N        Server: Serve up to N concurrent sessions, further\n");
+				printf("                             clients get a BUSY reply (default: %d)\n", MAX_CLIENTS);
 				printf("\n");
 				printf("https://github.com/grisu48/pingpong\n");
 				exit(EXIT_SUCCESS);
@@ -78,6 +555,226 @@ int main(int argc, char** argv) {
 					exit(EXIT_FAILURE);
 				}
 				warmup_s = atoi(argv[++i]);
+			} else if(!strcmp("--mlock", arg)) {
+				lock_buffers = true;
+			} else if(!strcmp("--busy-poll", arg)) {
+				busy_poll = true;
+			} else if(!strcmp("--cpu", arg)) {
+				if(i >= argc-1) {
+					fprintf(stderr, "Missing cpu\n");
+					exit(EXIT_FAILURE);
+				}
+				pin_cpu = atoi(argv[++i]);
+			} else if(!strcmp("--size", arg)) {
+				if(i >= argc-1) {
+					fprintf(stderr, "Missing size\n");
+					exit(EXIT_FAILURE);
+				}
+				test_size = parse_size(argv[++i]);
+				if(test_size <= 0) {
+					fprintf(stderr, "Illegal size: %s\n", argv[i]);
+					exit(EXIT_FAILURE);
+				}
+			} else if(!strcmp("--probes", arg)) {
+				if(i >= argc-1) {
+					fprintf(stderr, "Missing number of probes\n");
+					exit(EXIT_FAILURE);
+				}
+				owd_probes = atoi(argv[++i]);
+				if(owd_probes < 0 || owd_probes > MAX_PROBES) {
+					fprintf(stderr, "Illegal number of probes (0-%d): %s\n", MAX_PROBES, argv[i]);
+					exit(EXIT_FAILURE);
+				}
+			} else if(!strcmp("--probe-interval", arg)) {
+				if(i >= argc-1) {
+					fprintf(stderr, "Missing probe interval\n");
+					exit(EXIT_FAILURE);
+				}
+				owd_interval_ms = atoi(argv[++i]);
+			} else if(!strcmp("-P", arg)) {
+				if(i >= argc-1) {
+					fprintf(stderr, "Missing number of streams\n");
+					exit(EXIT_FAILURE);
+				}
+				streams = atoi(argv[++i]);
+				if(streams < 1) {
+					fprintf(stderr, "Illegal number of streams: %d\n", streams);
+					exit(EXIT_FAILURE);
+				}
+			} else if(!strcmp("-t", arg)) {
+				if(i >= argc-1) {
+					fprintf(stderr, "Missing duration\n");
+					exit(EXIT_FAILURE);
+				}
+				duration_s = atof(argv[++i]);
+				if(duration_s <= 0) {
+					fprintf(stderr, "Illegal duration: %s\n", argv[i]);
+					exit(EXIT_FAILURE);
+				}
+			} else if(!strcmp("-i", arg)) {
+				if(i >= argc-1) {
+					fprintf(stderr, "Missing interval\n");
+					exit(EXIT_FAILURE);
+				}
+				interval_s = atof(argv[++i]);
+				if(interval_s <= 0) {
+					fprintf(stderr, "Illegal interval: %s\n", argv[i]);
+					exit(EXIT_FAILURE);
+				}
+			} else if(!strcmp("-u", arg) || !strcmp("--udp", arg)) {
+				if(i >= argc-1) {
+					fprintf(stderr, "Missing rate\n");
+					exit(EXIT_FAILURE);
+				}
+				udp_rate = parse_rate(argv[++i]);
+				if(udp_rate <= 0) {
+					fprintf(stderr, "Illegal rate: %s\n", argv[i]);
+					exit(EXIT_FAILURE);
+				}
+			} else if(!strcmp("--depth", arg)) {
+				if(i >= argc-1) {
+					fprintf(stderr, "Missing depth\n");
+					exit(EXIT_FAILURE);
+				}
+				if(!strcmp("sweep", argv[++i])) depth = -1;
+				else {
+					depth = atoi(argv[i]);
+					if(depth < 1) {
+						fprintf(stderr, "Illegal depth: %s\n", argv[i]);
+						exit(EXIT_FAILURE);
+					}
+				}
+			} else if(!strcmp("--sockopt", arg)) {
+				if(i >= argc-1) {
+					fprintf(stderr, "Missing socket option\n");
+					exit(EXIT_FAILURE);
+				}
+				const char* spec = argv[++i];
+				const char* eq = strchr(spec, '=');
+				int opt = SOCKOPTS;
+				for(int j=0;j<SOCKOPTS && eq != NULL;j++)
+					if(strlen(sockopt_defs[j].name) == (size_t)(eq-spec) && !strncmp(sockopt_defs[j].name, spec, eq-spec)) opt = j;
+				if(opt == SOCKOPTS) {
+					fprintf(stderr, "Illegal socket option: %s\n", spec);
+					exit(EXIT_FAILURE);
+				}
+				char values[256];
+				snprintf(values, sizeof(values), "%s", eq+1);
+				sweep_count[opt] = 0;
+				for(char *value = strtok(values, ","); value != NULL; value = strtok(NULL, ",")) {
+					const long v = strcmp("default", value) ? parse_size(value) : -1;
+					if((v < 0 && strcmp("default", value)) || v > INT32_MAX || sweep_count[opt] >= MAX_SWEEP_VALUES) {
+						fprintf(stderr, "Illegal value for %s: %s\n", sockopt_defs[opt].name, value);
+						exit(EXIT_FAILURE);
+					}
+					sweep_values[opt][sweep_count[opt]++] = v;
+				}
+				if(sweep_count[opt] == 0) {
+					fprintf(stderr, "Missing value for %s\n", sockopt_defs[opt].name);
+					exit(EXIT_FAILURE);
+				}
+				sockopts[opt] = sweep_values[opt][0];
+			} else if(!strcmp("--zerocopy", arg)) {
+				zerocopy = true;
+			} else if(!strcmp("--zerocopy-compare", arg)) {
+				zerocopy_compare = true;
+				zerocopy = true;
+			} else if(!strcmp("--connections", arg)) {
+				if(i >= argc-1) {
+					fprintf(stderr, "Missing number of connections\n");
+					exit(EXIT_FAILURE);
+				}
+				load_connections = atoi(argv[++i]);
+				if(load_connections < 1) {
+					fprintf(stderr, "Illegal number of connections: %s\n", argv[i]);
+					exit(EXIT_FAILURE);
+				}
+			} else if(!strcmp("--ramp", arg)) {
+				if(i >= argc-1) {
+					fprintf(stderr, "Missing ramp rate\n");
+					exit(EXIT_FAILURE);
+				}
+				load_ramp = parse_rate(argv[++i]);
+				if(load_ramp <= 0) {
+					fprintf(stderr, "Illegal ramp rate: %s\n", argv[i]);
+					exit(EXIT_FAILURE);
+				}
+			} else if(!strcmp("--keepalive", arg)) {
+				if(i >= argc-1) {
+					fprintf(stderr, "Missing keepalive interval\n");
+					exit(EXIT_FAILURE);
+				}
+				keepalive_ms = atoi(argv[++i]);
+				if(keepalive_ms < 1) {
+					fprintf(stderr, "Illegal keepalive interval: %s\n", argv[i]);
+					exit(EXIT_FAILURE);
+				}
+			} else if(!strcmp("--metrics", arg)) {
+				if(i >= argc-1) {
+					fprintf(stderr, "Missing metrics port\n");
+					exit(EXIT_FAILURE);
+				}
+				metrics_port = atoi(argv[++i]);
+			} else if(!strcmp("--rate", arg)) {
+				if(i >= argc-1) {
+					fprintf(stderr, "Missing rate\n");
+					exit(EXIT_FAILURE);
+				}
+				open_rate = parse_rate(argv[++i]);
+				if(open_rate <= 0) {
+					fprintf(stderr, "Illegal rate: %s\n", argv[i]);
+					exit(EXIT_FAILURE);
+				}
+			} else if(!strcmp("--udp-size", arg)) {
+				if(i >= argc-1) {
+					fprintf(stderr, "Missing udp size\n");
+					exit(EXIT_FAILURE);
+				}
+				udp_size = atoi(argv[++i]);
+				if(udp_size < UDP_HEADER || udp_size > 65507) {
+					fprintf(stderr, "Illegal udp size (%d-%d): %s\n", UDP_HEADER, 65507, argv[i]);
+					exit(EXIT_FAILURE);
+				}
+			} else if(!strcmp("--mode", arg)) {
+				if(i >= argc-1) {
+					fprintf(stderr, "Missing mode\n");
+					exit(EXIT_FAILURE);
+				}
+				const char* name = argv[++i];
+				if(!strcmp("echo", name)) mode = MODE_ECHO;
+				else if(!strcmp("send", name)) mode = MODE_SEND;
+				else if(!strcmp("reverse", name)) mode = MODE_REVERSE;
+				else if(!strcmp("duplex", name)) mode = MODE_DUPLEX;
+				else {
+					fprintf(stderr, "Illegal mode: %s\n", name);
+					exit(EXIT_FAILURE);
+				}
+			} else if(!strcmp("--legacy", arg)) {
+				proto_request = 1;
+			} else if(!strcmp("--iterations", arg)) {
+				if(i >= argc-1) {
+					fprintf(stderr, "Missing number of iterations\n");
+					exit(EXIT_FAILURE);
+				}
+				iterations = atoi(argv[++i]);
+				if(iterations < 1) {
+					fprintf(stderr, "Illegal number of iterations: %d\n", iterations);
+					exit(EXIT_FAILURE);
+				}
+			} else if(!strcmp("--timestamps", arg)) {
+				sw_timestamps = true;
+			} else if(!strcmp("--tsc", arg)) {
+				tsc = true;
+			} else if(!strcmp("--max-clients", arg)) {
+				if(i >= argc-1) {
+					fprintf(stderr, "Missing number of clients\n");
+					exit(EXIT_FAILURE);
+				}
+				max_clients = atoi(argv[++i]);
+				if(max_clients < 1) {
+					fprintf(stderr, "Illegal number of clients: %d\n", max_clients);
+					exit(EXIT_FAILURE);
+				}
 			} else {
 				fprintf(stderr, "Illegal argument: %s\n", arg);
 				printf("Type %s --help if you need help\n", argv[0]);
@@ -95,12 +792,21 @@ int main(int argc, char** argv) {
 	}
 	
 	atexit(cleanup);
+	timing_init(tsc);
 	int rc = 0;
 	if(server) {
 		rc = run_server(port);
 	} else {
 		printf("%s:%d\n", remote, port);
-		rc = run_client(remote, port);
+		if(udp_rate > 0) rc = run_udp(remote, port);
+		else if(load_connections > 0) rc = run_load(remote, port);
+		else if(open_rate > 0) rc = run_open_loop(remote, port);
+		else if(depth != 0) rc = run_depth(remote, port);
+		else if(zerocopy_compare) rc = run_zerocopy(remote, port);
+		else if(sweep_configs() > 1) rc = run_sweep(remote, port);
+		else if(duration_s > 0) rc = run_timed(remote, port);
+		else if(streams > 1 || mode != MODE_ECHO) rc = run_parallel(remote, port);
+		else rc = run_client(remote, port);
 	}
 	if(rc != 0)
 		exit(EXIT_FAILURE);
@@ -108,90 +814,678 @@ int main(int argc, char** argv) {
 }
 
 
+/** Sessions handed from the acceptor to the worker pool. Admission is decided on `sessions`
+  * (queued plus running), so the queue never holds more than max_clients sockets */
 typedef struct {
-	int sock;
-} s_thread_params_t;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int *fds;					// Ring buffer of accepted sockets waiting for a worker
+	int head;
+	int count;
+	int sessions;				// Admitted sessions that are not finished yet
+} session_queue_t;
 
-void * tcp_client(void * args) {
-	// Make parameters thread-local and free memory
-	s_thread_params_t *params = (s_thread_params_t*)args;
-	const int sock = params->sock;
-	free(params);
+static session_queue_t queue = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0, 0 };
 
-	// Disable Nagle's algorithm
+/** MSG_ZEROCOPY state of the socket of this thread (zc_setup) */
+typedef struct {
+	bool enabled;			// Send with MSG_ZEROCOPY
+	uint32_t issued;		// Zerocopy sends, the kernel numbers their completions from 0
+	uint32_t completed;		// Completions received from the error queue
+	uint64_t copied;		// Completed sends the kernel had to copy after all (e.g. loopback)
+} zc_t;
+
+static __thread zc_t zc;
+
+/** Enable zerocopy sends on the socket of this thread, if requested with --zerocopy */
+static void zc_setup(const int sock) {
+	bzero(&zc, sizeof(zc));
+	if(!zerocopy) return;
 	int one = 1;
-	if(setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *)&one, sizeof(int)) < 0)
-		fprintf(stderr, "Warning: Failed to set TCP_NODELAY for new socket: %s\n", strerror(errno));
+	if(setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0)
+		fprintf(stderr, "Warning: Failed to set SO_ZEROCOPY, using copying sends: %s\n", strerror(errno));
+	else
+		zc.enabled = true;
+}
 
-	size_t received = 0L;
-	while(true) {
-		// First receive size of packet
-		char msg[9] = {'\0'};
-		ssize_t l_recv = recv(sock, msg, 8, MSG_WAITALL);
-		if(l_recv < 0) {
-			fprintf(stderr, "recv failed: %s\n", strerror(errno));
-			break;
-		} else if(l_recv == 0) {
-			break;
-		} else if(l_recv < 8) {
-			fprintf(stderr, "Incomplete header\n");
-			break;
+/** Read the zerocopy completions from the error queue of the socket
+  * @param wait Wait until all zerocopy sends have completed, i.e. the kernel no longer reads the buffers
+  * @returns 0 on success, -1 on error */
+static int zc_reap(const int sock, const bool wait) {
+	char control[256];
+	while(zc.completed != zc.issued) {
+		struct msghdr msg;
+		bzero(&msg, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if(recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return -1;
+			if(!wait) return 0;
+			// Completions are signalled with POLLERR. They may take a while (ACK of the data)
+			struct pollfd pfd = { sock, 0, 0 };
+			const int rc = poll(&pfd, 1, 1000);
+			if(rc < 0 && errno != EINTR) return -1;
+			if(rc == 0) {
+				errno = ETIMEDOUT;
+				return -1;
+			} else if(rc > 0 && !(pfd.revents & POLLERR)) {
+				errno = ECONNRESET;
+				return -1;
+			}
+			continue;
 		}
-		msg[8] = '\0';
-		if(!strcmp("CLOSE", msg)) {
-			break;
-		} else if(!strcmp("PING", msg)) {
-			if(send(sock, "PONG", 4, MSG_DONTWAIT) < 0) {
-				fprintf(stderr, "pong failed: %s\n", strerror(errno));
-				break;
+		for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if(cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_RECVERR) continue;
+			struct sock_extended_err serr;
+			memcpy(&serr, CMSG_DATA(cmsg), sizeof(serr));
+			if(serr.ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr.ee_errno != 0) continue;
+			// One notification covers the sends ee_info to ee_data
+			const uint32_t n = serr.ee_data - serr.ee_info + 1;
+			zc.completed += n;
+			if(serr.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) zc.copied += n;
+		}
+	}
+	return 0;
+}
+
+/** send() that uses MSG_ZEROCOPY if enabled. The buffer must not be modified until the send has
+  * completed (zc_reap). If the pending completions exhaust the socket option memory, they are
+  * reaped and the call fails with EAGAIN */
+static ssize_t zc_send(const int sock, const void *buf, const size_t len, const int flags) {
+	if(!zc.enabled) return send(sock, buf, len, flags);
+	ssize_t rc = send(sock, buf, len, flags | MSG_ZEROCOPY);
+	if(rc > 0) zc.issued++;
+	else if(rc < 0 && errno == ENOBUFS) {
+		if(zc_reap(sock, false) < 0) return -1;
+		errno = EAGAIN;
+	}
+	return rc;
+}
+
+/** Send all len bytes like send_all, zerocopy if enabled. The buffer may only be reused after zc_reap
+  * @returns number of bytes sent or -1 on error */
+static ssize_t zc_send_all(const int sock, const void *buf, const size_t len) {
+	size_t sent = 0;
+	while(sent < len) {
+		ssize_t rc = zc_send(sock, (const char*)buf + sent, len - sent, MSG_NOSIGNAL);
+		if(rc < 0) {
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN && zc.enabled) {
+				if(zc_reap(sock, true) < 0) return -1;
+				continue;
 			}
-		} else {
-			long size = atol(msg);
-			//printf("Receiving %ld bytes ... \n", size);
+			return -1;
+		}
+		sent += (size_t)rc;
+		if(zc.enabled && zc_reap(sock, false) < 0) return -1;
+	}
+	return (ssize_t)sent;
+}
 
-			// Allocate buffer before receiving!
-			char* buf = malloc(sizeof(char)*size);
-			if(buf == NULL) {
-				fprintf(stderr, "malloc failed: %s\n", strerror(errno));
-				sprintf(msg, "ERR     ");
-				send(sock, msg, 8, 0);
-				break;
+/** Fallback of the relay for clients that stall it, e.g. older clients that only start reading once
+  * they have sent the whole message: Echo chunk by chunk in the relay buffer with blocking sends, so
+  * that memory stays bounded and the backpressure of a slow client stays in the socket. A client
+  * that does not read at all for STALL_TIMEOUT_MS is given up
+  * @param off Offset of the received but not yet echoed data in buf
+  * @param len Received but not yet echoed data
+  * @param remaining Bytes of the message that have not been received yet
+  * @returns 0 on success, -1 on error */
+static int relay_blocking(const int sock, char *buf, size_t off, size_t len, size_t remaining) {
+	while(true) {
+		while(len > 0) {
+			struct pollfd pfd = { sock, POLLOUT, 0 };
+			int rc = poll(&pfd, 1, STALL_TIMEOUT_MS);
+			if(rc < 0 && errno == EINTR) continue;
+			if(rc == 0) {
+				fprintf(stderr, "Client does not read the echo, giving up (%zu bytes left)\n", len + remaining);
+				return -1;
+			} else if(rc < 0) {
+				fprintf(stderr, "poll failed: %s\n", strerror(errno));
+				return -1;
 			}
-			bzero(buf, sizeof(char)*size);
-			sprintf(msg, "OK      ");
-			if(send(sock, msg, 8, MSG_DONTWAIT) < 0) {
-				fprintf(stderr, "send failed: %s\n", strerror(errno));
-				break;
+			ssize_t l_send = zc_send(sock, buf + off, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+			if(l_send < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				fprintf(stderr, "send_bw failed: %s\n", strerror(errno));
+				return -1;
+			} else if(l_send > 0) {
+				off += (size_t)l_send;
+				len -= (size_t)l_send;
 			}
+		}
+		if(remaining == 0) return 0;
+		if(zc.enabled && zc_reap(sock, true) < 0) {
+			fprintf(stderr, "zerocopy completion failed: %s\n", strerror(errno));
+			return -1;
+		}
+		const size_t chunk = (remaining > (size_t)CHUNK_SIZE) ? (size_t)CHUNK_SIZE : remaining;
+		ssize_t l_recv = recv_all(sock, buf, chunk);
+		if(l_recv < 0) {
+			fprintf(stderr, "recv failed: %s\n", strerror(errno));
+			return -1;
+		} else if((size_t)l_recv < chunk) {
+			fprintf(stderr, "Incomplete recv\n");
+			return -1;
+		}
+		off = 0;
+		len = chunk;
+		remaining -= chunk;
+	}
+}
 
-			ssize_t len = recv(sock, buf, (size_t)size, MSG_WAITALL);
-			if(len < 0) {
-				fprintf(stderr, "recv failed: %s\n", strerror(errno));
-				break;
-			} else if(len < size) {
-				fprintf(stderr, "Incomplete recv: %s\n", strerror(errno));
+/** Echo a message of the given size back to the sender while it is still being received,
+  * so that the memory per session is bounded by the relay buffer buf (CHUNK_SIZE bytes)
+  * @returns 0 on success, -1 on error */
+static int relay(const int sock, char *buf, const size_t size) {
+	size_t received = 0, sent = 0;
+	size_t off = 0, len = 0;		// Received but not yet echoed data in buf
+	long stall_start = -1;
+
+	while(sent < size) {
+		// Zerocopy: The kernel may still read the already sent part of the buffer, which can
+		// only be reused once all sends have completed
+		if(zc.enabled && zc_reap(sock, false) < 0) {
+			fprintf(stderr, "zerocopy completion failed: %s\n", strerror(errno));
+			return -1;
+		}
+		const bool reusable = zc.completed == zc.issued;
+		if(len == 0 && reusable) off = 0;
+		else if(off + len == CHUNK_SIZE && off > 0 && reusable) {
+			memmove(buf, buf + off, len);
+			off = 0;
+		}
+		const bool can_recv = received < size && off + len < CHUNK_SIZE;
+
+		struct pollfd pfd = { sock, 0, 0 };
+		if(can_recv) pfd.events |= POLLIN;
+		if(len > 0) pfd.events |= POLLOUT;
+		if(busy_poll) pfd.revents = pfd.events;
+		else {
+			int rc = poll(&pfd, 1, (can_recv || !reusable) ? -1 : STALL_MS);
+			if(rc < 0) {
+				if(errno == EINTR) continue;
+				fprintf(stderr, "poll failed: %s\n", strerror(errno));
+				return -1;
 			}
-			// Back to the sender
-			len = send(sock, buf, (size_t)size, 0);
-			if(len < 0) {
+		}
+
+		bool progress = false;
+		if(pfd.revents & (POLLOUT | POLLERR | POLLHUP) && len > 0) {
+			ssize_t rc = zc_send(sock, buf + off, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+			if(rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
 				fprintf(stderr, "send_bw failed: %s\n", strerror(errno));
-				break;
+				return -1;
+			} else if(rc > 0) {
+				off += (size_t)rc;
+				len -= (size_t)rc;
+				sent += (size_t)rc;
+				progress = true;
 			}
-			received += (size_t)size;
-			free(buf);
+		}
+		if(pfd.revents & (POLLIN | POLLERR | POLLHUP) && can_recv) {
+			size_t space = CHUNK_SIZE - (off + len);
+			if(space > size - received) space = size - received;
+			ssize_t rc = recv(sock, buf + off + len, space, MSG_DONTWAIT);
+			if(rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				fprintf(stderr, "recv failed: %s\n", strerror(errno));
+				return -1;
+			} else if(rc == 0) {
+				fprintf(stderr, "Incomplete recv\n");
+				return -1;
+			} else if(rc > 0) {
+				len += (size_t)rc;
+				received += (size_t)rc;
+				progress = true;
+			}
+		}
+		if(busy_poll && !progress) sched_yield();		// Like recv_all, spinning must not starve the peer on the same cpu
+
+		// A full buffer that the client does not drain means it is not reading while sending
+		if(progress || can_recv || received == size || !reusable) {
+			stall_start = -1;
+		} else if(stall_start < 0) {
+			stall_start = now_ms();
+		} else if(now_ms() - stall_start >= STALL_MS) {
+			if(relay_blocking(sock, buf, off, len, size - received) < 0) return -1;
+			break;
 		}
 	}
+	// The next message is received into the same buffer
+	if(zc.enabled && zc_reap(sock, true) < 0) {
+		fprintf(stderr, "zerocopy completion failed: %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
 
-	//printf("Transferred %ld (x2) bytes\n", received);
-	return NULL;
+/** Resident memory of this process in bytes */
+static size_t resident_bytes() {
+	FILE *f = fopen("/proc/self/statm", "r");
+	if(f == NULL) return 0;
+	unsigned long size = 0, resident = 0;
+	if(fscanf(f, "%lu %lu", &size, &resident) != 2) resident = 0;
+	fclose(f);
+	return resident * (size_t)sysconf(_SC_PAGESIZE);
 }
 
-int run_server(const int port) {
-	int sock = 0;
-	
-	
-    struct sockaddr_in addr; 
-    memset(&addr, 0, sizeof(addr)); 
+/** Receiver state of a udp test */
+typedef struct {
+	uint8_t *seen;			// Bitmap of the last UDP_WINDOW sequence numbers (seq % UDP_WINDOW)
+	uint64_t max_seq;		// Highest sequence number so far
+	int64_t last_transit;	// Transit time (receive - send) of the previous datagram
+	double jitter;			// RFC 3550 interarrival jitter (ns)
+	uint64_t first_rx, last_rx;
+	uint64_t values[UDP_RESULTS];
+} udp_receiver_t;
+
+/** Account one received test datagram */
+static int udp_account(udp_receiver_t *rx, const unsigned char *dgram, const size_t len, const uint64_t t_rx) {
+	if(len < UDP_HEADER) return 0;
+	uint64_t seq_tx, ts_tx;
+	memcpy(&seq_tx, dgram, 8);
+	memcpy(&ts_tx, dgram + 8, 8);
+	seq_tx = be64toh(seq_tx);
+	ts_tx = be64toh(ts_tx);
+
+	rx->values[UDP_RECEIVED]++;
+	rx->values[UDP_BYTES] += len;
+
+	// Duplicates: Sliding bitmap anchored at the highest sequence number, so that the memory does not
+	// depend on the (unchecked) sequence numbers on the wire. Moving it forward clears the skipped bits
+	const bool first = rx->values[UDP_RECEIVED] == 1;
+	if(first || (seq_tx > rx->max_seq && seq_tx - rx->max_seq >= UDP_WINDOW))
+		memset(rx->seen, 0, UDP_WINDOW / 8);
+	else if(seq_tx > rx->max_seq) {
+		for(uint64_t s = rx->max_seq + 1; s <= seq_tx; s++)
+			rx->seen[(s % UDP_WINDOW) / 8] &= (uint8_t)~(1 << (s % 8));
+	}
+	// Datagrams from behind the window are too late to tell, they only count as reordered
+	if(seq_tx > rx->max_seq || rx->max_seq - seq_tx < UDP_WINDOW) {
+		const uint64_t bit = seq_tx % UDP_WINDOW;
+		if(rx->seen[bit / 8] & (1 << (bit % 8))) {
+			rx->values[UDP_DUPLICATES]++;
+			return 0;
+		}
+		rx->seen[bit / 8] |= (uint8_t)(1 << (bit % 8));
+	}
+
+	// Reordering: Arrived after a later datagram, the depth is the distance to the highest sequence number
+	if(rx->values[UDP_RECEIVED] > 1 && seq_tx < rx->max_seq) {
+		rx->values[UDP_REORDERED]++;
+		if(rx->max_seq - seq_tx > rx->values[UDP_REORDER_DEPTH]) rx->values[UDP_REORDER_DEPTH] = rx->max_seq - seq_tx;
+	} else
+		rx->max_seq = seq_tx;
+
+	// RFC 3550 jitter: J += (|D(i-1,i)| - J)/16, the clock offset between the hosts cancels out
+	const int64_t transit = (int64_t)(t_rx - ts_tx);
+	if(rx->values[UDP_RECEIVED] > 1) {
+		const double d = fabs((double)(transit - rx->last_transit));
+		rx->jitter += (d - rx->jitter) / 16.0;
+	} else
+		rx->first_rx = t_rx;
+	rx->last_transit = transit;
+	rx->last_rx = t_rx;
+	return 0;
+}
+
+/** Receive all pending test datagrams
+  * @returns 0 on success, -1 on error */
+static int udp_drain(const int fd, udp_receiver_t *rx, unsigned char *buf) {
+	struct mmsghdr msgs[UDP_BATCH];
+	struct iovec iovs[UDP_BATCH];
+	for(int i=0;i<UDP_BATCH;i++) {
+		iovs[i].iov_base = buf + (size_t)i * UDP_MAX;
+		iovs[i].iov_len = UDP_MAX;
+		bzero(&msgs[i], sizeof(msgs[i]));
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	while(true) {
+		int n = recvmmsg(fd, msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+		if(n < 0) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			if(errno == EINTR) continue;
+			return -1;
+		}
+		const uint64_t t_rx = now_ns();
+		for(int i=0;i<n;i++) {
+			if(udp_account(rx, buf + (size_t)i * UDP_MAX, msgs[i].msg_len, t_rx) < 0) return -1;
+		}
+		if(n < UDP_BATCH) return 0;
+	}
+}
+
+/** Server side of a udp test: Bind an ephemeral udp port, tell it the client and receive the
+  * test datagrams until the client ends the test on the control connection
+  * @returns 0 on success, -1 on error */
+static int udp_receiver(const int sock, const frame_t *req) {
+	int rc = -1;
+	udp_receiver_t rx;
+	bzero(&rx, sizeof(rx));
+	unsigned char *buf = malloc((size_t)UDP_BATCH * UDP_MAX);
+	rx.seen = malloc(UDP_WINDOW / 8);
+	const int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if(buf == NULL || rx.seen == NULL || fd < 0) {
+		fprintf(stderr, "udp setup failed: %s\n", strerror(errno));
+		goto finish;
+	}
+	int rcvbuf = 16*1024*1024;
+	if(setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0)
+		fprintf(stderr, "Warning: Failed to set SO_RCVBUF: %s\n", strerror(errno));
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	bzero(&addr, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = INADDR_ANY;
+	addr.sin_port = 0;
+	if(bind(fd, (const struct sockaddr*)&addr, sizeof(addr)) < 0 || getsockname(fd, (struct sockaddr*)&addr, &addrlen) < 0) {
+		fprintf(stderr, "udp bind failed: %s\n", strerror(errno));
+		goto finish;
+	}
+
+	frame_t rep = *req;
+	rep.flags = 0;
+	rep.reserved = 0;
+	rep.ts_rx = now_ns();
+	rep.len = 8;
+	rep.ts_tx = now_ns();
+	uint64_t udp_port = htobe64(ntohs(addr.sin_port));
+	if(send_frame(sock, &rep) < 0 || send_all(sock, &udp_port, 8) < 0) goto finish;
+
+	frame_t end;
+	while(true) {
+		struct pollfd pfds[2] = { { fd, POLLIN, 0 }, { sock, POLLIN, 0 } };
+		if(poll(pfds, 2, -1) < 0) {
+			if(errno == EINTR) continue;
+			goto finish;
+		}
+		if(pfds[0].revents & POLLIN && udp_drain(fd, &rx, buf) < 0) goto finish;
+		if(pfds[1].revents) {
+			if(recv_frame(sock, &end) <= 0) goto finish;
+			if(end.type != FRAME_UDP_END) {
+				fprintf(stderr, "Illegal request type %d during udp test\n", end.type);
+				goto finish;
+			}
+			break;
+		}
+	}
+	// Late datagrams
+	while(true) {
+		struct pollfd pfd = { fd, POLLIN, 0 };
+		int n = poll(&pfd, 1, UDP_DRAIN_MS);
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0) break;
+		if(udp_drain(fd, &rx, buf) < 0) goto finish;
+	}
+
+	rx.values[UDP_JITTER] = (uint64_t)rx.jitter;
+	rx.values[UDP_DURATION] = rx.last_rx - rx.first_rx;
+	for(int i=0;i<UDP_RESULTS;i++) rx.values[i] = htobe64(rx.values[i]);
+	rep = end;
+	rep.ts_rx = rx.last_rx;
+	rep.len = sizeof(rx.values);
+	rep.ts_tx = now_ns();
+	if(send_frame(sock, &rep) < 0 || send_all(sock, rx.values, sizeof(rx.values)) < 0) goto finish;
+	rc = 0;
+finish:
+	if(fd >= 0) close(fd);
+	free(rx.seen);
+	free(buf);
+	return rc;
+}
+
+/** Serve a protocol v2 session after the handshake
+  * @param buf The relay buffer of the worker (CHUNK_SIZE bytes)
+  * @param received Accumulated bytes echoed in this session
+  * @param faults Page faults of this thread at the beginning of the session */
+static void session_v2(const int sock, char *buf, size_t *received, const long faults) {
+	long opts[SOCKOPTS];		// Socket options requested by the client
+	for(int i=0;i<SOCKOPTS;i++) opts[i] = -1;
+	while(true) {
+		frame_t req;
+		int rc = recv_frame(sock, &req);
+		const uint64_t ts_rx = now_ns();
+		if(rc < 0) fprintf(stderr, "recv failed: %s\n", strerror(errno));
+		if(rc <= 0) return;
+
+		frame_t rep = req;
+		rep.flags = 0;
+		rep.reserved = 0;
+		rep.ts_rx = ts_rx;
+		switch(req.type) {
+			case FRAME_CLOSE:
+				return;
+			case FRAME_PING:
+				rep.type = FRAME_PONG;
+				rep.len = 0;
+				rep.ts_tx = now_ns();
+				if(send_frame(sock, &rep) < 0) goto fail;
+				break;
+			case FRAME_DATA:
+				message_begin(sock, opts);
+				if(req.flags & FRAME_FLAG_DISCARD) {
+					// Send-only: Reply once the payload is complete, so the client sees the upload time
+					for(uint64_t discarded = 0; discarded < req.len; ) {
+						size_t len = (req.len - discarded > (uint64_t)CHUNK_SIZE) ? (size_t)CHUNK_SIZE : (size_t)(req.len - discarded);
+						ssize_t l_recv = recv_all(sock, buf, len);
+						if(l_recv <= 0 || (size_t)l_recv < len) {
+							if(l_recv < 0) fprintf(stderr, "recv failed: %s\n", strerror(errno));
+							else fprintf(stderr, "Incomplete recv\n");
+							return;
+						}
+						discarded += len;
+					}
+					rep.ts_rx = now_ns();
+					rep.ts_tx = rep.ts_rx;
+					if(send_frame(sock, &rep) < 0) goto fail;
+					message_end(sock, opts);
+					*received += req.len;
+					break;
+				}
+				// Reply header first, then echo the payload while receiving it
+				rep.ts_tx = now_ns();
+				if(send_frame(sock, &rep) < 0) goto fail;
+				if(relay(sock, buf, req.len) < 0) return;
+				message_end(sock, opts);
+				*received += req.len;
+				break;
+			case FRAME_REVERSE:
+				message_begin(sock, opts);
+				rep.ts_tx = now_ns();
+				if(send_frame(sock, &rep) < 0) goto fail;
+				for(uint64_t sent = 0; sent < req.len; ) {
+					size_t len = (req.len - sent > (uint64_t)CHUNK_SIZE) ? (size_t)CHUNK_SIZE : (size_t)(req.len - sent);
+					if(zc_send_all(sock, buf, len) < 0) goto fail;
+					sent += len;
+				}
+				message_end(sock, opts);
+				if(zc.enabled && zc_reap(sock, true) < 0) goto fail;
+				*received += req.len;
+				break;
+			case FRAME_SOCKOPT: {
+				// Whole 8 byte records only. The stream cannot be resynchronized after a bad length, so end the session
+				if(req.len == 0 || req.len % 8 != 0 || req.len > 8 * 256) {
+					fprintf(stderr, "Illegal socket option length %lu\n", req.len);
+					rep.type = FRAME_ERR;
+					rep.len = 0;
+					rep.ts_tx = now_ns();
+					send_frame(sock, &rep);
+					return;
+				}
+				// Options the server does not know yet are skipped
+				for(uint64_t i=0;i<req.len;i+=8) {
+					uint64_t value;
+					if(recv_all(sock, &value, 8) < 8) {
+						fprintf(stderr, "recv failed: %s\n", strerror(errno));
+						return;
+					}
+					value = be64toh(value);
+					if(i/8 < SOCKOPTS) opts[i/8] = (value > INT32_MAX) ? -1 : (long)value;
+				}
+				rep.len = 0;
+				if(apply_sockopts(sock, opts) < 0) rep.type = FRAME_ERR;
+				rep.ts_tx = now_ns();
+				if(send_frame(sock, &rep) < 0) goto fail;
+				break; }
+			case FRAME_STATS: {
+				uint64_t values[STATS_COUNT];
+				pthread_mutex_lock(&queue.lock);
+				values[STAT_SESSIONS] = (uint64_t)queue.sessions;
+				pthread_mutex_unlock(&queue.lock);
+				values[STAT_MAX_CLIENTS] = (uint64_t)max_clients;
+				values[STAT_BYTES] = (uint64_t)*received;
+				values[STAT_FAULTS] = (uint64_t)(thread_faults() - faults);
+				values[STAT_RSS] = (uint64_t)resident_bytes();
+				for(int i=0;i<STATS_COUNT;i++) values[i] = htobe64(values[i]);
+				rep.len = sizeof(values);
+				rep.ts_tx = now_ns();
+				if(send_frame(sock, &rep) < 0 || send_all(sock, values, sizeof(values)) < 0) goto fail;
+				break; }
+			case FRAME_UDP:
+				if(udp_receiver(sock, &req) < 0) return;
+				break;
+			default:
+				fprintf(stderr, "Illegal request type %d\n", req.type);
+				rep.type = FRAME_ERR;
+				rep.len = 0;
+				rep.ts_tx = now_ns();
+				send_frame(sock, &rep);
+				return;
+		}
+	}
+fail:
+	fprintf(stderr, "send failed: %s\n", strerror(errno));
+}
+
+/** Serve one client session on the given socket until the client closes it
+  * @param buf The relay buffer of the worker (CHUNK_SIZE bytes) */
+static void tcp_client(const int sock, char *buf) {
+	// Disable Nagle's algorithm
+	int one = 1;
+	if(setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *)&one, sizeof(int)) < 0)
+		fprintf(stderr, "Warning: Failed to set TCP_NODELAY for new socket: %s\n", strerror(errno));
+	if(busy_poll) setup_busy_poll(sock);
+	zc_setup(sock);
+	pin_thread(pin_cpu);
+
+	const long faults = thread_faults();
+	size_t received = 0L;
+	while(true) {
+		// First receive size of packet
+		char msg[9] = {'\0'};
+		ssize_t l_recv = recv_all(sock, msg, 8);
+		if(l_recv < 0) {
+			fprintf(stderr, "recv failed: %s\n", strerror(errno));
+			break;
+		} else if(l_recv == 0) {
+			break;
+		} else if(l_recv < 8) {
+			fprintf(stderr, "Incomplete header\n");
+			break;
+		}
+		msg[8] = '\0';
+		if(!strncmp(PROTO_MAGIC, msg, strlen(PROTO_MAGIC))) {
+			// Version negotiation: We speak the lower of both versions
+			int version = msg[7] - '0';
+			if(version < 2) {
+				fprintf(stderr, "Illegal protocol version: %s\n", msg);
+				send(sock, "ERR     ", 8, MSG_NOSIGNAL);
+				break;
+			}
+			if(version > PROTO_VERSION) version = PROTO_VERSION;
+			snprintf(msg, 9, "%s%d", PROTO_MAGIC, version);
+			if(send_all(sock, msg, 8) < 0) {
+				fprintf(stderr, "send failed: %s\n", strerror(errno));
+				break;
+			}
+			session_v2(sock, buf, &received, faults);
+			break;
+		} else if(!strcmp("CLOSE", msg)) {
+			break;
+		} else if(!strncmp("PING", msg, 4)) {
+			if(send(sock, "PONG    ", 8, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+				fprintf(stderr, "pong failed: %s\n", strerror(errno));
+				break;
+			}
+		} else {
+			long size = parse_size(msg);
+			if(size < 0) {
+				fprintf(stderr, "Illegal size header: %s\n", msg);
+				send(sock, "ERR     ", 8, MSG_NOSIGNAL);
+				break;
+			}
+			//printf("Receiving %ld bytes ... \n", size);
+
+			sprintf(msg, "OK      ");
+			if(send(sock, msg, 8, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+				fprintf(stderr, "send failed: %s\n", strerror(errno));
+				break;
+			}
+			// Echo back while receiving
+			if(relay(sock, buf, (size_t)size) < 0) break;
+			received += (size_t)size;
+		}
+	}
+
+	printf("Session finished: %zu bytes echoed, %ld page faults\n", received, thread_faults() - faults);
+	fflush(stdout);
+}
+
+/** Pool worker: Take the next admitted session from the queue and serve it */
+static void * session_worker(void * args) {
+	(void)args;
+	// Allocated with the first session and reused for all further sessions of this worker, so that
+	// idle workers cost no memory
+	char *buf = NULL;
+	while(true) {
+		pthread_mutex_lock(&queue.lock);
+		while(queue.count == 0)
+			pthread_cond_wait(&queue.cond, &queue.lock);
+		const int fd = queue.fds[queue.head];
+		queue.head = (queue.head + 1) % max_clients;
+		queue.count--;
+		pthread_mutex_unlock(&queue.lock);
+
+		if(buf == NULL) buf = buf_alloc(CHUNK_SIZE);
+		if(buf == NULL)
+			fprintf(stderr, "Cannot allocate worker buffer: %s\n", strerror(errno));
+		else
+			tcp_client(fd, buf);
+		close(fd);
+
+		pthread_mutex_lock(&queue.lock);
+		queue.sessions--;
+		pthread_mutex_unlock(&queue.lock);
+	}
+	return NULL;
+}
+
+/** Admit a freshly accepted client to the worker pool or turn it away with a BUSY reply
+  * @returns true if the client has been admitted, false if it has been rejected */
+static bool admit_client(const int fd) {
+	pthread_mutex_lock(&queue.lock);
+	const bool admitted = queue.sessions < max_clients;
+	if(admitted) {
+		queue.fds[(queue.head + queue.count) % max_clients] = fd;
+		queue.count++;
+		queue.sessions++;
+		pthread_cond_signal(&queue.cond);
+	}
+	pthread_mutex_unlock(&queue.lock);
+	if(admitted) return true;
+
+	// The client reads this as reply to its first request
+	if(send(fd, "BUSY    ", 8, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+		fprintf(stderr, "busy reply failed: %s\n", strerror(errno));
+	close(fd);
+	return false;
+}
+
+int run_server(const int port) {
+	int sock = 0;
+	
+	
+    struct sockaddr_in addr; 
+    memset(&addr, 0, sizeof(addr)); 
     addr.sin_family = AF_INET; 
     addr.sin_port = htons(port); 
     addr.sin_addr.s_addr = INADDR_ANY; 
@@ -209,33 +1503,59 @@ int run_server(const int port) {
     	return -1;
     }
     
-    rc = listen(sock, 5);
+    rc = listen(sock, SOMAXCONN);
 	if(rc < 0) {
 		fprintf(stderr, "Listening failed: %s\n", strerror(errno));
     	close(sock);
     	return -1;
 	}
 
+	// Fixed worker pool, one worker per admitted session
+	queue.fds = (int*)malloc(sizeof(int) * max_clients);
+	if(queue.fds == NULL) {
+		fprintf(stderr, "out of memory\n");
+		close(sock);
+		return -1;
+	}
+	for(int i=0;i<max_clients;i++) {
+		pthread_t tid;
+		rc = pthread_create(&tid, NULL, session_worker, NULL);
+		if(rc != 0) {
+			fprintf(stderr, "error creating worker thread: %s\n", strerror(rc));
+			close(sock);
+			return -1;
+		}
+		pthread_detach(tid);
+	}
+	printf("Serving up to %d concurrent sessions on port %d\n", max_clients, port);
+
 	// Run while socket is opened
 	while(sock > 0) {
 		struct sockaddr client_addr;
 		socklen_t addrlen = sizeof(client_addr);
 		const int fd = accept(sock, &client_addr, &addrlen);
-
-		pthread_t tid;
-		s_thread_params_t *params = (s_thread_params_t*)malloc(sizeof(s_thread_params_t));
-		if(params == NULL) {
-			fprintf(stderr, "out of memory");
-			return -1;
-		}
-		params->sock = fd;
-		int rc = pthread_create(&tid, NULL, tcp_client, params);
-		if(rc < 0) {
-			free(params);
-			fprintf(stderr, "error creating tcp client thread: %s\n", strerror(errno));
-			return -1;
+		if(fd < 0) {
+			switch(errno) {
+				case EINTR:
+				case ECONNABORTED:
+				case EPROTO:
+					continue;
+				case EMFILE:
+				case ENFILE:
+				case ENOBUFS:
+				case ENOMEM:
+					// Out of resources, give the running sessions a chance to finish
+					fprintf(stderr, "accept failed: %s\n", strerror(errno));
+					usleep(100*1000);
+					continue;
+				default:
+					fprintf(stderr, "accept failed: %s\n", strerror(errno));
+					close(sock);
+					return -1;
+			}
 		}
-		pthread_detach(tid);
+		if(!admit_client(fd))
+			fprintf(stderr, "Rejected client: %d sessions active\n", max_clients);
 	}
 
     close(sock);
@@ -247,235 +1567,1898 @@ typedef struct {
 	long s;
 } pair_l;
 
-typedef struct {
-	long avg;
-	long min;
-	long max;
-} stats_l;
-
-static stats_l stats(const long* arr, const size_t n) {
-	stats_l ret;
-	ret.avg = 0;
-	ret.min = 0;
-	ret.max = 0;
-	if(n < 1) return ret;
-	ret.avg = 0;
-	ret.min = arr[0];
-	ret.max = arr[0];
-
-	for(size_t i=0;i<n;i++) {
-		const long v = arr[i];
-		if(v < ret.min) ret.min = v;
-		if(v > ret.max) ret.max = v;
-		ret.avg += v;
-	}
-	ret.avg /= n;
+/** Percentiles of the latency reports */
+static const double percentiles[] = { 50, 90, 99, 99.9, 99.99 };
+#define PERCENTILES (int)(sizeof(percentiles)/sizeof(percentiles[0]))
 
+/** Format min, the percentiles and max of a histogram of durations in ns */
+static char* str_hist(char* buf, const size_t size, const hist_t *hist) {
+	char strbuf[32];
+	size_t len = snprintf(buf, size, "min %s", str_ns(strbuf, 32, hist->min));
+	for(int i=0;i<PERCENTILES && len < size;i++)
+		len += snprintf(buf + len, size - len, ", p%g %s", percentiles[i], str_ns(strbuf, 32, hist_percentile(hist, percentiles[i])));
+	if(len < size) snprintf(buf + len, size - len, ", max %s", str_ns(strbuf, 32, hist->max));
+	return buf;
+}
 
-	return ret;
+/** Terminate with a clear message, if the server rejected us because it is at its session limit */
+static void check_busy(const char* reply) {
+	if(!strncmp("BUSY", reply, 4)) {
+		fprintf(stderr, "Server busy: Too many concurrent sessions, try again later\n");
+		exit(EXIT_FAILURE);
+	}
 }
 
-long ping(const int sock) {
-	struct timeval t1, t2, t_delta;
-	char buf[9];
-	bzero(buf, 9);
-	gettimeofday(&t1, NULL);
-	if(send(sock, "PING    ", 8, 0) < 0) return -1;
-	if(recv(sock, buf, 8, MSG_WAITALL) < 0) return -1;
-	gettimeofday(&t2, NULL);
-	timersub(&t2, &t1, &t_delta);
-	return (t_delta.tv_usec + t_delta.tv_sec * 1000L*1000L);
+/** Request our protocol version from the server
+  * @returns negotiated protocol version (1 for legacy servers) or -1 on error */
+static int handshake(const int sock) {
+	char msg[9] = {'\0'};
+	snprintf(msg, 9, "%s%d", PROTO_MAGIC, PROTO_VERSION);
+	if(send_all(sock, msg, 8) < 0) return -1;
+	if(recv_all(sock, msg, 8) < 8) return -1;
+	check_busy(msg);
+	if(!strncmp(PROTO_MAGIC, msg, strlen(PROTO_MAGIC))) return msg[7] - '0';
+	// Legacy servers take the magic for an empty message
+	if(!strncmp("OK", msg, 2)) return 1;
+	errno = EPROTO;
+	return -1;
 }
 
-/** Perform a bandwith test on the given socket by sending the given amout of bytes */
-pair_l bw_test(const int sock, const size_t size) {
-	pair_l ret;
-	ret.f = -1L;
-	ret.s = -1L;
+/** Send the header of a v2 request
+  * @returns sequence number of the request or 0 on error */
+static uint64_t send_request(const int sock, const frame_type_t type, const uint16_t flags, const uint64_t len) {
+	frame_t req;
+	bzero(&req, sizeof(req));
+	req.type = type;
+	req.flags = flags;
+	req.seq = ++seq;
+	req.len = len;
+	req.ts = now_ns();
+	return (send_frame(sock, &req) < 0) ? 0 : req.seq;
+}
 
-	char * buf = malloc(sizeof(char)*(size+1));
-	if(buf == NULL) {
-		fprintf(stderr, "malloc failed: %s\n", strerror(errno));
-		return ret;
+/** Receive the reply header to the request with the given sequence number
+  * @returns 0 on success, -1 on error */
+static int recv_reply(const int sock, const uint64_t req_seq, frame_t *reply) {
+	int rc = recv_frame(sock, reply);
+	if(rc == 0) errno = ECONNRESET;
+	if(rc <= 0) return -1;
+	if(reply->seq != req_seq || reply->type == FRAME_ERR) {
+		errno = EPROTO;
+		return -1;
 	}
+	return 0;
+}
 
-	memset(buf, 'a', size);		// TODO: Randomize data
-	buf[size] = '\0';
+/** Send a v2 request and receive the reply header
+  * @returns 0 on success, -1 on error */
+static int request(const int sock, const frame_type_t type, const uint64_t len, frame_t *reply) {
+	const uint64_t req_seq = send_request(sock, type, 0, len);
+	if(req_seq == 0) return -1;
+	return recv_reply(sock, req_seq, reply);
+}
 
-	// Send size
-	char msg[9] = {'\0'};
-	sprintf(msg, "%ld", size);
-	if(send(sock, msg, 8, 0) < 0) {
-		fprintf(stderr, "send failed: %s\n", strerror(errno));
-		free(buf);
-		return ret;
+/** Query the server statistics of this session (protocol v2)
+  * @returns 0 on success, -1 on error */
+static int server_stats(const int sock, uint64_t values[STATS_COUNT]) {
+	frame_t reply;
+	bzero(values, sizeof(uint64_t) * STATS_COUNT);
+	if(request(sock, FRAME_STATS, 0, &reply) < 0) {
+		fprintf(stderr, "stats request failed: %s\n", strerror(errno));
+		return -1;
 	}
-	if(recv(sock, msg, 8, MSG_WAITALL) < 8) {
-		fprintf(stderr, "recv failed: %s\n", strerror(errno));
-		free(buf);
-		return ret;
-	}
-	if(!strcmp("OK", msg)) {
-		fprintf(stderr, "Illegal response\n");
-		free(buf);
-		return ret;
+	// Newer servers may send more values than we know
+	for(uint64_t i=0;i<reply.len;i+=8) {
+		uint64_t value;
+		if(recv_all(sock, &value, 8) < 8) {
+			fprintf(stderr, "stats recv failed: %s\n", strerror(errno));
+			return -1;
+		}
+		if(i/8 < STATS_COUNT) values[i/8] = be64toh(value);
 	}
+	return 0;
+}
 
-	// Send packet
-	struct timeval t1, t2, t3, t_delta;
-	gettimeofday(&t1, NULL);
-	ssize_t slen = send(sock, buf, size, 0);
-	gettimeofday(&t2, NULL);
-	if(slen < 0) {
-		fprintf(stderr, "send_bw failed: %s\n", strerror(errno));
-		return ret;
-	}
-	timersub(&t2, &t1, &t_delta);
-	ret.f = (t_delta.tv_usec + t_delta.tv_sec * 1000L*1000L);
-	
-	// Now wait for the data
-	slen = recv(sock, buf, size, MSG_WAITALL);
-	free(buf);
-	gettimeofday(&t3, NULL);
-	if(slen < 0) {
-		fprintf(stderr, "recv_bw failed: %s\n", strerror(errno));
-		return ret;
-	} else if((size_t)slen < size) {
-		fprintf(stderr, "incomplete received: %ld/%ld\n", slen, size);
-		return ret;
+/** Query and print the server statistics of this session (protocol v2) */
+static void print_server_stats(const int sock) {
+	uint64_t values[STATS_COUNT];
+	if(server_stats(sock, values) < 0) return;
+	printf("Server: %lu page faults, %.1f MB resident, %lu/%lu sessions\n", values[STAT_FAULTS], values[STAT_RSS]/(1024.0*1024.0), values[STAT_SESSIONS], values[STAT_MAX_CLIENTS]);
+}
+
+/** Round trip of a PING message
+  * @returns round trip time in ns or -1 on error */
+long ping(const int sock) {
+	char buf[9];
+	bzero(buf, 9);
+	const uint64_t t1 = time_ns();
+	if(proto >= 2) {
+		frame_t reply;
+		if(request(sock, FRAME_PING, 0, &reply) < 0) return -1;
+		if(reply.type != FRAME_PONG) {
+			errno = EPROTO;
+			return -1;
+		}
+	} else {
+		if(send(sock, "PING    ", 8, 0) < 0) return -1;
+		if(recv_all(sock, buf, 8) < 0) return -1;
+		check_busy(buf);
 	}
-	timersub(&t3, &t2, &t_delta);
-	ret.s = (t_delta.tv_usec + t_delta.tv_sec * 1000L*1000L);
+	return (long)(time_ns() - t1);
+}
 
-	return ret;
+/** Kernel software timestamps of one PING exchange in ns (CLOCK_REALTIME) */
+typedef struct {
+	uint64_t send;		// User space, before sendmsg
+	uint64_t tx;		// Kernel, the request has been handed to the device
+	uint64_t rx;		// Kernel, the reply has been received from the device
+	uint64_t recv;		// User space, after recvmsg returned the complete reply
+} stamps_t;
+
+/** Enable software timestamps on the given socket. RX timestamps are reported for every receive,
+  * TX timestamps are only generated for sends that request them (send_stamped)
+  * @returns 0 on success, -1 on error */
+static int setup_timestamps(const int sock) {
+	int flags = SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+	return setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
 }
 
-void warmup(const int sock, int seconds) {
-	struct timeval t1, t2, t_delta;
-	long size = 10240;
+/** Software timestamp of a SCM_TIMESTAMPING control message of msg
+  * @returns timestamp in ns or 0 if msg carries none */
+static uint64_t cmsg_timestamp(struct msghdr *msg) {
+	for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_TIMESTAMPING) continue;
+		struct scm_timestamping tss;
+		memcpy(&tss, CMSG_DATA(cmsg), sizeof(tss));
+		// ts[0] is the software timestamp, ts[2] the hardware timestamp
+		return (uint64_t)tss.ts[0].tv_sec * 1000000000UL + (uint64_t)tss.ts[0].tv_nsec;
+	}
+	return 0;
+}
 
+/** Send len bytes and request a software TX timestamp for them
+  * @returns 0 on success, -1 on error */
+static int send_stamped(const int sock, const void *buf, const size_t len) {
+	char control[CMSG_SPACE(sizeof(uint32_t))];
+	bzero(control, sizeof(control));
+	struct iovec iov = { (void*)buf, len };
+	struct msghdr msg;
+	bzero(&msg, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SO_TIMESTAMPING;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(uint32_t));
+	const uint32_t flags = SOF_TIMESTAMPING_TX_SOFTWARE;
+	memcpy(CMSG_DATA(cmsg), &flags, sizeof(flags));
+	ssize_t rc;
+	while((rc = sendmsg(sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+	if(rc < 0) return -1;
+	// The timestamp belongs to the last byte of the first part, good enough for a small message
+	if((size_t)rc < len && send_all(sock, (const char*)buf + rc, len - (size_t)rc) < 0) return -1;
+	return 0;
+}
 
-	gettimeofday(&t1, NULL);
-	while(true) {
-		gettimeofday(&t2, NULL);
-		timersub(&t2, &t1, &t_delta);
-		if(((long)t_delta.tv_sec+t_delta.tv_usec/(1000L*1000L)) > (long)seconds) break;
-		pair_l ret = bw_test(sock, size);
-		if(ret.f < 0 || ret.s < 0) {
-			fprintf(stderr,"warumup failed\n");
-			return;
+/** Receive exactly len bytes and the software RX timestamp of the last segment
+  * @returns 0 on success, -1 on error */
+static int recv_stamped(const int sock, void *buf, const size_t len, uint64_t *ts) {
+	char control[256];
+	size_t received = 0;
+	*ts = 0;
+	while(received < len) {
+		struct iovec iov = { (char*)buf + received, len - received };
+		struct msghdr msg;
+		bzero(&msg, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		ssize_t rc = recvmsg(sock, &msg, busy_poll ? MSG_DONTWAIT : 0);
+		if(rc < 0) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) { sched_yield(); continue; }
+			return -1;
+		} else if(rc == 0) {
+			errno = ECONNRESET;
+			return -1;
 		}
+		received += (size_t)rc;
+		const uint64_t t = cmsg_timestamp(&msg);
+		if(t > 0) *ts = t;
 	}
+	return 0;
 }
 
-static char* str_speed(char* buf, size_t size, const double speed) {
-	if(speed > 1.2e9) {
-		double gb = speed*1e-9;
-		snprintf(buf, size, "%5.2f GB/s (%5.2f Gb/s)", gb, gb*8.0);
-	} else if(speed > 1.2e6) {
-		double mb = speed*1e-6;
-		snprintf(buf, size, "%5.2f MB/s (%5.2f Mb/s)", mb, mb*8.0);
-	} else if(speed > 1.2e3) {
-		double kb = speed*1e-3;
-		snprintf(buf, size, "%5.2f KB/s (%5.2f Kb/s)", kb, kb*8.0);
-	} else {
-		snprintf(buf, size, "%5.2f B/s (%5.2f b/s)", speed, speed*8.0);
+/** Fetch the pending TX timestamps from the error queue of the socket
+  * @returns the latest TX timestamp in ns, 0 if there is none */
+static uint64_t recv_tx_timestamp(const int sock) {
+	uint64_t ts = 0;
+	char control[256];
+	// The timestamp is queued when the request leaves the host, which is before the reply arrives.
+	// Wait a little nevertheless, it may be late on a busy host
+	struct pollfd pfd = { sock, POLLERR, 0 };
+	if(poll(&pfd, 1, 100) <= 0) return 0;
+	while(true) {
+		struct msghdr msg;
+		bzero(&msg, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if(recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) break;
+		const uint64_t t = cmsg_timestamp(&msg);
+		if(t > 0) ts = t;
 	}
-	return buf;
+	return ts;
 }
 
-int run_client(const char* remote, const int port) {
-	int sock = 0;
-    struct sockaddr_in addr; 
-    memset(&addr, 0, sizeof(addr)); 
-      
-    // Filling server information 
-    addr.sin_family = AF_INET; 
-    addr.sin_port = htons(port); 
-    addr.sin_addr.s_addr = inet_addr(remote); 
-
-
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    if(sock < 0) {
-    	fprintf(stderr, "Error creating socket: %s\n", strerror(errno));
-    	return -1;
-    }
-	socklen_t addrlen = sizeof(addr);
-	int rc = connect(sock, (const struct sockaddr *)&addr, addrlen);
-	if(rc < 0) {
-		fprintf(stderr, "Connect failed: %s\n", strerror(errno));
-		close(sock);
-		exit(EXIT_FAILURE);
+/** PING with kernel software timestamps (setup_timestamps), to split the round trip into the time
+  * in our own network stack and the time on the wire and in the remote host
+  * @returns 0 on success, -1 on error */
+static int ping_stamped(const int sock, stamps_t *stamps) {
+	unsigned char buf[FRAME_SIZE];
+	size_t len = 8;
+	if(proto >= 2) {
+		frame_t req;
+		bzero(&req, sizeof(req));
+		req.type = FRAME_PING;
+		req.seq = ++seq;
+		req.ts = now_ns();
+		frame_encode(&req, buf);
+		len = FRAME_SIZE;
+	} else
+		memcpy(buf, "PING    ", 8);
+	stamps->send = now_ns();
+	if(send_stamped(sock, buf, len) < 0) return -1;
+	if(recv_stamped(sock, buf, len, &stamps->rx) < 0) return -1;
+	stamps->recv = now_ns();
+	if(proto >= 2) {
+		frame_t reply;
+		frame_decode(&reply, buf);
+		if(reply.type != FRAME_PONG || reply.seq != seq) {
+			errno = EPROTO;
+			return -1;
+		}
 	}
-	// Disable Nagle's algorithm for ping 
-	int one = 1;
-	if(setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *)&one, sizeof(int)) < 0)
-		fprintf(stderr, "Warning: Failed to set TCP_NODELAY for new socket: %s\n", strerror(errno));
-
+	stamps->tx = recv_tx_timestamp(sock);
+	return 0;
+}
 
-	// First run a warmup
-	if(warmup_s > 0) {
-		printf("Warmup %d seconds ... \n", warmup_s);
-		warmup(sock, warmup_s);
+/** Break the round trip of --iterations pings into host stack and wire plus remote time and print
+  * both as histograms (min, percentiles, max). Pings without usable timestamps are left out */
+static void print_ping_stamps(const int sock) {
+	if(setup_timestamps(sock) < 0) {
+		fprintf(stderr, "Warning: Failed to enable SO_TIMESTAMPING: %s\n", strerror(errno));
+		return;
 	}
-
-	long bytes[] = {128L,256L,512L,1024L,2048L,4096L,10240L,40960L,81920L,122880L,163840L,204800L,327680L,409600L,819200L,1228800L,1638400L, 3276800L, 4915200L, 6553600L, 65536000L};
-	const int nTests =(sizeof(bytes)/sizeof(bytes[0]));
-	printf("Running %d tests with %d iterations each\n\n", nTests, SERIES);
-	
-	// First do a ping test
-	{
-		long ping_us = ping(sock);
-		
-		long ping_avg = ping_us;
-		long ping_worst = ping_us;
-		
-		if(ping_us < 0) {
+	static hist_t host, wire;
+	hist_reset(&host);
+	hist_reset(&wire);
+	for(int i=0;i<iterations;i++) {
+		stamps_t stamps;
+		if(ping_stamped(sock, &stamps) < 0) {
 			fprintf(stderr, "Ping failed: %s\n", strerror(errno));
 			exit(EXIT_FAILURE);
 		}
-		for(int i=0;i<SERIES-1;i++) {
-			long t = ping(sock);
-			if(t < 0) {
-				fprintf(stderr, "Ping failed: %s\n", strerror(errno));
-				exit(EXIT_FAILURE);
-			}
-			if(t < ping_us) ping_us = t;
-			if(t > ping_worst) ping_worst = t;
-			ping_avg += t;
-		}
-		ping_avg /= SERIES;
-		printf("  Ping (min avg max) : %ld %ld %ld µs\n\n", ping_us, ping_avg, ping_worst);
+		// Missing or inconsistent timestamps (e.g. the wall clock has been stepped)
+		if(stamps.tx == 0 || stamps.rx == 0) continue;
+		if(stamps.tx < stamps.send || stamps.rx < stamps.tx || stamps.recv < stamps.rx) continue;
+		hist_record(&host, (long)((stamps.tx - stamps.send) + (stamps.recv - stamps.rx)));
+		hist_record(&wire, (long)(stamps.rx - stamps.tx));
+	}
+	if(host.count == 0) {
+		fprintf(stderr, "Warning: The kernel did not report software timestamps\n");
+		return;
 	}
-	
-	printf("%10s\t%5s\t%5s\t%5s\t%7s\n","Size", "t_vg", "t_min", "t_max", "bandwidth");
-	double max_speed = 0;
 	char strbuf[256];
-	for(size_t i=0;i<(size_t)nTests;i++) {
-		long size = bytes[i];
+	printf("  Host stack  : %s\n", str_hist(strbuf, 256, &host));
+	printf("  Wire+remote : %s\n\n", str_hist(strbuf, 256, &wire));
+}
+
+/** Timestamps of one PING/PONG exchange in ns. t1 and t4 are taken with the client clock,
+  * t2 and t3 with the server clock */
+typedef struct {
+	int64_t t1;		// Client send
+	int64_t t2;		// Server receive
+	int64_t t3;		// Server send
+	int64_t t4;		// Client receive
+} owd_sample_t;
+
+/** Clock offset (server - client) of a sample, ns */
+static double owd_offset(const owd_sample_t *s) {
+	return ((double)(s->t2 - s->t1) + (double)(s->t3 - s->t4)) / 2.0;
+}
+
+/** Network round-trip delay of a sample without the server residence time, ns */
+static double owd_delay(const owd_sample_t *s) {
+	return (double)(s->t4 - s->t1) - (double)(s->t3 - s->t2);
+}
+
+/** Estimate the clock offset between client and server from many PING/PONG exchanges (protocol v2)
+  * and report forward delay, reverse delay and server residence time separately.
+  *
+  * As in NTP, every sample gives an offset with an error of at most half of its network delay.
+  * The offset is taken from the sample with the smallest delay, so the error bound of the
+  * one-way delays is half of that delay. The drift is the slope of a linear regression over
+  * the minimum-delay sample of every window of 10 probes, it is only applied if it is
+  * significant (more than twice its standard error). */
+static int one_way_delay(const int sock) {
+	const int n = owd_probes;
+	const int window = 10;
+	owd_sample_t *samples = (owd_sample_t*)malloc(sizeof(owd_sample_t) * n);
+	double *x = (double*)malloc(sizeof(double) * 2 * (n / window + 1));		// Regression points, y follows x
+	if(samples == NULL || x == NULL) {
+		fprintf(stderr, "malloc failed: %s\n", strerror(errno));
+		free(samples);
+		free(x);
+		return -1;
+	}
+	double *y = x + (n / window + 1);
+	for(int i=0;i<n;i++) {
+		frame_t reply;
+		if(request(sock, FRAME_PING, 0, &reply) < 0) {
+			fprintf(stderr, "probe failed: %s\n", strerror(errno));
+			free(samples);
+			free(x);
+			return -1;
+		}
+		samples[i].t4 = (int64_t)now_ns();
+		samples[i].t1 = (int64_t)reply.ts;
+		samples[i].t2 = (int64_t)reply.ts_rx;
+		samples[i].t3 = (int64_t)reply.ts_tx;
+		if(owd_interval_ms > 0 && i < n-1) usleep(owd_interval_ms * 1000);
+	}
+
+	// Minimum-delay sample per window, x relative to the first probe to keep the precision
+	const int64_t t0 = samples[0].t1;
+	double x_avg = 0, y_avg = 0;
+	int m = 0, best = 0;
+	for(int w=0;w<n;w+=window) {
+		int min = w;
+		for(int i=w;i<n && i<w+window;i++) {
+			if(owd_delay(&samples[i]) < owd_delay(&samples[min])) min = i;
+		}
+		if(owd_delay(&samples[min]) < owd_delay(&samples[best])) best = min;
+		x[m] = (double)(samples[min].t1 - t0);
+		y[m] = owd_offset(&samples[min]);
+		x_avg += x[m];
+		y_avg += y[m];
+		m++;
+	}
+	x_avg /= m;
+	y_avg /= m;
+	double drift = 0, sxx = 0, sxy = 0;
+	for(int i=0;i<m;i++) {
+		sxx += (x[i] - x_avg) * (x[i] - x_avg);
+		sxy += (x[i] - x_avg) * (y[i] - y_avg);
+	}
+	if(m > 2 && sxx > 0) {
+		const double slope = sxy / sxx;
+		double sse = 0;
+		for(int i=0;i<m;i++) {
+			const double r = y[i] - (y_avg + slope * (x[i] - x_avg));
+			sse += r * r;
+		}
+		const double se = sqrt(sse / (m - 2) / sxx);
+		if(fabs(slope) > 2.0 * se) drift = slope;
+	}
+	const double offset = owd_offset(&samples[best]);
+	const int64_t t_best = samples[best].t1;
+	const double err = owd_delay(&samples[best]) / 2.0;
+
+	// Apply the estimated offset at the time of every sample
+	double fwd[3] = { 0, 0, 0 }, rev[3] = { 0, 0, 0 }, res[3] = { 0, 0, 0 };	// min, avg, max
+	for(int i=0;i<n;i++) {
+		const owd_sample_t *s = &samples[i];
+		const double theta = offset + drift * (double)(s->t1 - t_best);
+		const double f = (double)(s->t2 - s->t1) - theta;
+		const double r = (double)(s->t4 - s->t3) + theta;
+		const double d = (double)(s->t3 - s->t2);
+		if(i == 0 || f < fwd[0]) fwd[0] = f;
+		if(i == 0 || f > fwd[2]) fwd[2] = f;
+		if(i == 0 || r < rev[0]) rev[0] = r;
+		if(i == 0 || r > rev[2]) rev[2] = r;
+		if(i == 0 || d < res[0]) res[0] = d;
+		if(i == 0 || d > res[2]) res[2] = d;
+		fwd[1] += f / n;
+		rev[1] += r / n;
+		res[1] += d / n;
+	}
+	free(samples);
+	free(x);
+
+	printf("  Clock offset          : %+.1f µs ± %.1f µs, drift %+.2f ppm (%d probes)\n", offset*1e-3, err*1e-3, drift*1e6, n);
+	printf("  Forward (min avg max) : %.1f %.1f %.1f µs ± %.1f µs\n", fwd[0]*1e-3, fwd[1]*1e-3, fwd[2]*1e-3, err*1e-3);
+	printf("  Reverse (min avg max) : %.1f %.1f %.1f µs ± %.1f µs\n", rev[0]*1e-3, rev[1]*1e-3, rev[2]*1e-3, err*1e-3);
+	printf("  Server  (min avg max) : %.1f %.1f %.1f µs residence\n\n", res[0]*1e-3, res[1]*1e-3, res[2]*1e-3);
+	return 0;
+}
+
+/** Perform a bandwith test on the given socket by sending the given amout of bytes.
+  * Sending and receiving are interleaved, so that the server can echo while we are still sending
+  * @returns time needed to send the message and time from then until the echo is complete in ns */
+pair_l bw_test(const int sock, const size_t size) {
+	pair_l ret;
+	ret.f = -1L;
+	ret.s = -1L;
+
+	// The message is sent in chunks from the same buffer, memory does not depend on the size
+	const char * buf = client_buf;		// TODO: Randomize data
+	char * rbuf = client_buf + CHUNK_SIZE;
+
+	// Send size
+	if(proto >= 2) {
+		frame_t reply;
+		if(request(sock, FRAME_DATA, size, &reply) < 0) {
+			fprintf(stderr, "data request failed: %s\n", strerror(errno));
+			return ret;
+		}
+	} else {
+		char msg[9] = {'\0'};
+		if(format_size(msg, (long)size) < 0) {
+			fprintf(stderr, "Cannot express size %ld in the header\n", size);
+			return ret;
+		}
+		if(send(sock, msg, 8, 0) < 0) {
+			fprintf(stderr, "send failed: %s\n", strerror(errno));
+			return ret;
+		}
+		if(recv_all(sock, msg, 8) < 8) {
+			fprintf(stderr, "recv failed: %s\n", strerror(errno));
+			return ret;
+		}
+		check_busy(msg);
+		if(strncmp("OK", msg, 2)) {
+			fprintf(stderr, "Illegal response\n");
+			return ret;
+		}
+	}
+
+	// Send packet and receive the echo
+	message_begin(sock, sockopts);
+	const uint64_t t1 = time_ns();
+	uint64_t t2 = t1;
+	size_t sent = 0, received = 0;
+	while(received < size) {
+		bool progress = false;
+		struct pollfd pfd = { sock, POLLIN, 0 };
+		if(sent < size) pfd.events |= POLLOUT;
+		if(busy_poll) pfd.revents = pfd.events;
+		else if(poll(&pfd, 1, -1) < 0) {
+			if(errno == EINTR) continue;
+			fprintf(stderr, "poll failed: %s\n", strerror(errno));
+			return ret;
+		}
+		if(sent < size && pfd.revents & (POLLOUT | POLLERR | POLLHUP)) {
+			size_t len = size - sent;
+			if(len > (size_t)CHUNK_SIZE) len = CHUNK_SIZE;
+			// The send buffer is never modified, so zerocopy sends can reuse it before they completed
+			ssize_t slen = zc_send(sock, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+			if(slen < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				fprintf(stderr, "send_bw failed: %s\n", strerror(errno));
+				return ret;
+			} else if(slen > 0) {
+				sent += (size_t)slen;
+				progress = true;
+				if(sent == size) {
+					t2 = time_ns();
+					message_end(sock, sockopts);
+				}
+			}
+		}
+		if(zc.enabled && pfd.revents & POLLERR && zc_reap(sock, false) < 0) {
+			fprintf(stderr, "zerocopy completion failed: %s\n", strerror(errno));
+			return ret;
+		}
+		if(pfd.revents & (POLLIN | POLLERR | POLLHUP)) {
+			ssize_t rlen = recv(sock, rbuf, CHUNK_SIZE, MSG_DONTWAIT);
+			if(rlen < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				fprintf(stderr, "recv_bw failed: %s\n", strerror(errno));
+				return ret;
+			} else if(rlen == 0) {
+				fprintf(stderr, "incomplete received: %ld/%ld\n", received, size);
+				return ret;
+			} else if(rlen > 0) {
+				received += (size_t)rlen;
+				progress = true;
+			}
+		}
+		if(busy_poll && !progress) sched_yield();
+	}
+	const uint64_t t3 = time_ns();
+	if(zc.enabled && zc_reap(sock, true) < 0) {
+		fprintf(stderr, "zerocopy completion failed: %s\n", strerror(errno));
+		return ret;
+	}
+	ret.f = (long)(t2 - t1);
+	ret.s = (long)(t3 - t2);
+
+	return ret;
+}
+
+/** Upload test (protocol v2): Send a message that the server discards
+  * @returns time until the server confirmed the complete message in ns or -1 on error */
+static long send_test(const int sock, const size_t size) {
+	const uint64_t t1 = time_ns();
+	const uint64_t req_seq = send_request(sock, FRAME_DATA, FRAME_FLAG_DISCARD, size);
+	if(req_seq == 0) return -1;
+	message_begin(sock, sockopts);
+	for(size_t sent = 0; sent < size; ) {
+		const size_t len = (size - sent > (size_t)CHUNK_SIZE) ? (size_t)CHUNK_SIZE : size - sent;
+		if(zc_send_all(sock, client_buf, len) < 0) return -1;
+		sent += len;
+	}
+	message_end(sock, sockopts);
+	frame_t reply;
+	if(recv_reply(sock, req_seq, &reply) < 0) return -1;
+	if(zc.enabled && zc_reap(sock, true) < 0) return -1;
+	return (long)(time_ns() - t1);
+}
+
+/** Download test (protocol v2): Request a message from the server
+  * @returns time until the message has been received completely in ns or -1 on error */
+static long reverse_test(const int sock, const size_t size) {
+	const uint64_t t1 = time_ns();
+	frame_t reply;
+	if(request(sock, FRAME_REVERSE, size, &reply) < 0) return -1;
+	for(size_t received = 0; received < size; ) {
+		const size_t len = (size - received > (size_t)CHUNK_SIZE) ? (size_t)CHUNK_SIZE : size - received;
+		ssize_t l_recv = recv_all(sock, client_buf + CHUNK_SIZE, len);
+		if(l_recv < 0) return -1;
+		else if((size_t)l_recv < len) {
+			errno = ECONNRESET;
+			return -1;
+		}
+		received += len;
+	}
+	return (long)(time_ns() - t1);
+}
+
+void warmup(const int sock, int seconds) {
+	long size = 10240;
+
+
+	const uint64_t t1 = time_ns();
+	while(true) {
+		if(time_ns() - t1 > (uint64_t)seconds * 1000000000UL) break;
+		pair_l ret = bw_test(sock, size);
+		if(ret.f < 0 || ret.s < 0) {
+			fprintf(stderr,"warumup failed\n");
+			return;
+		}
+	}
+}
+
+static char* str_speed(char* buf, size_t size, const double speed) {
+	if(speed > 1.2e9) {
+		double gb = speed*1e-9;
+		snprintf(buf, size, "%5.2f GB/s (%5.2f Gb/s)", gb, gb*8.0);
+	} else if(speed > 1.2e6) {
+		double mb = speed*1e-6;
+		snprintf(buf, size, "%5.2f MB/s (%5.2f Mb/s)", mb, mb*8.0);
+	} else if(speed > 1.2e3) {
+		double kb = speed*1e-3;
+		snprintf(buf, size, "%5.2f KB/s (%5.2f Kb/s)", kb, kb*8.0);
+	} else {
+		snprintf(buf, size, "%5.2f B/s (%5.2f b/s)", speed, speed*8.0);
+	}
+	return buf;
+}
+
+/** Connect to the server and prepare the socket for the tests
+  * @returns socket or -1 on error */
+static int connect_server(const char* remote, const int port) {
+	int sock = 0;
+    struct sockaddr_in addr; 
+    memset(&addr, 0, sizeof(addr)); 
+      
+    // Filling server information 
+    addr.sin_family = AF_INET; 
+    addr.sin_port = htons(port); 
+    addr.sin_addr.s_addr = inet_addr(remote); 
+
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if(sock < 0) {
+    	fprintf(stderr, "Error creating socket: %s\n", strerror(errno));
+    	return -1;
+    }
+	// Before connect, so that the receive buffer sets the window scale and the mss is announced
+	if(apply_sockopts(sock, sockopts) < 0) {
+		close(sock);
+		return -1;
+	}
+	socklen_t addrlen = sizeof(addr);
+	int rc = connect(sock, (const struct sockaddr *)&addr, addrlen);
+	if(rc < 0) {
+		fprintf(stderr, "Connect failed: %s\n", strerror(errno));
+		close(sock);
+		return -1;
+	}
+	// Disable Nagle's algorithm for ping, unless given with --sockopt
+	int one = 1;
+	if(sockopts[SOCKOPT_NODELAY] < 0 && setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *)&one, sizeof(int)) < 0)
+		fprintf(stderr, "Warning: Failed to set TCP_NODELAY for new socket: %s\n", strerror(errno));
+	if(busy_poll) setup_busy_poll(sock);
+	zc_setup(sock);
+	return sock;
+}
+
+/** Allocate the transfer buffer of the calling stream and negotiate the protocol version.
+  * Call after pinning, so that the buffer is local to the cpu of the stream
+  * @returns 0 on success, -1 on error */
+static int open_session(const int sock) {
+	client_buf = buf_alloc(CHUNK_SIZE*2);
+	if(client_buf == NULL) {
+		fprintf(stderr, "Cannot allocate transfer buffer: %s\n", strerror(errno));
+		return -1;
+	}
+	proto = 1;
+	if(proto_request >= 2) {
+		proto = handshake(sock);
+		if(proto < 0) {
+			fprintf(stderr, "Handshake failed: %s\n", strerror(errno));
+			return -1;
+		}
+	}
+	// The server end gets the same socket options
+	bool any = false;
+	for(int i=0;i<SOCKOPTS;i++) any |= sockopts[i] >= 0;
+	if(any && proto >= 2) {
+		uint64_t values[SOCKOPTS];
+		for(int i=0;i<SOCKOPTS;i++) values[i] = htobe64((sockopts[i] < 0) ? UINT64_MAX : (uint64_t)sockopts[i]);
+		frame_t reply;
+		const uint64_t req_seq = send_request(sock, FRAME_SOCKOPT, 0, sizeof(values));
+		if(req_seq == 0 || send_all(sock, values, sizeof(values)) < 0 || recv_reply(sock, req_seq, &reply) < 0) {
+			fprintf(stderr, "Server refused the socket options: %s\n", strerror(errno));
+			return -1;
+		}
+	} else if(any) {
+		static bool warned = false;
+		if(!warned) fprintf(stderr, "Warning: Legacy server, the socket options only apply to the client end\n");
+		warned = true;
+	}
+	return 0;
+}
+
+/** End the session of the calling stream, close the socket and release the transfer buffer */
+static void close_session(const int sock) {
+	if(proto >= 2) {
+		frame_t req;
+		bzero(&req, sizeof(req));
+		req.type = FRAME_CLOSE;
+		req.seq = ++seq;
+		req.ts = now_ns();
+		send_frame(sock, &req);
+	} else {
+		char msg[8];
+		sprintf(msg, "CLOSE");
+		send(sock, msg, 8, 0);
+	}
+	close(sock);
+	buf_free(client_buf, CHUNK_SIZE*2);
+	client_buf = NULL;
+}
+
+/** Sizes to test, the size table or just --size
+  * @returns number of sizes */
+static int test_sizes(const long **sizes) {
+	if(test_size > 0) {
+		*sizes = &test_size;
+		return 1;
+	}
+	*sizes = bytes_table;
+	return (int)(sizeof(bytes_table)/sizeof(bytes_table[0]));
+}
+
+static char* str_rate(char* buf, size_t size, const double bits) {
+	if(bits > 1e9) snprintf(buf, size, "%.2f Gb/s", bits*1e-9);
+	else if(bits > 1e6) snprintf(buf, size, "%.2f Mb/s", bits*1e-6);
+	else if(bits > 1e3) snprintf(buf, size, "%.2f Kb/s", bits*1e-3);
+	else snprintf(buf, size, "%.2f b/s", bits);
+	return buf;
+}
+
+int run_client(const char* remote, const int port) {
+	const int sock = connect_server(remote, port);
+	if(sock < 0) exit(EXIT_FAILURE);
+	pin_thread(pin_cpu);
+	if(open_session(sock) < 0) {
+		close(sock);
+		return -1;
+	}
+	printf("Protocol version %d\n", proto);
+
+	// First run a warmup
+	if(warmup_s > 0) {
+		printf("Warmup %d seconds ... \n", warmup_s);
+		warmup(sock, warmup_s);
+	}
+
+	const long *bytes;
+	const int nTests = test_sizes(&bytes);
+	printf("Running %d tests with %d iterations each\n\n", nTests, iterations);
+	
+	// One histogram for the ping and then for every size, recording does not allocate
+	static hist_t hist;
+	char strbuf[256];
 
-		long tests[SERIES];
-		for(int i=0;i<SERIES;i++) {
+	// First do a ping test
+	hist_reset(&hist);
+	for(int i=0;i<iterations;i++) {
+		long t = ping(sock);
+		if(t < 0) {
+			fprintf(stderr, "Ping failed: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		hist_record(&hist, t);
+	}
+	printf("  Ping : %s\n\n", str_hist(strbuf, 256, &hist));
+	if(sw_timestamps) print_ping_stamps(sock);
+
+	// One-way delays need the server timestamps of protocol v2
+	if(proto >= 2 && owd_probes > 0 && one_way_delay(sock) < 0)
+		exit(EXIT_FAILURE);
+	
+	printf("%10s\t%10s", "Size", "t_min");
+	for(int i=0;i<PERCENTILES;i++) {
+		snprintf(strbuf, 256, "p%g", percentiles[i]);
+		printf("\t%10s", strbuf);
+	}
+	printf("\t%10s\t%-24s\t%6s\n", "t_max", "bandwidth", "faults");
+	double max_speed = 0;
+	char t_str[32];
+	for(size_t i=0;i<(size_t)nTests;i++) {
+		long size = bytes[i];
+
+		hist_reset(&hist);
+		const long faults = thread_faults();
+		for(int i=0;i<iterations;i++) {
 			pair_l l = bw_test(sock, size);
 			if(l.f < 0 || l.s < 0) {
 				fprintf(stderr, "error: %s\n", strerror(errno));
 				exit(EXIT_FAILURE);
 			}
-			tests[i] = (l.f + l.s) / 2L;
+			hist_record(&hist, (l.f + l.s) / 2L);
 		}
-		stats_l st = stats(tests, SERIES);
+		const long run_faults = thread_faults() - faults;
 		
-		double speed = size / (st.min) * 1e6;		// Bytes/s
-		printf("%10ld\t%5ld\t%5ld\t%5ld\t%7s\n", size, st.avg, st.min, st.max, str_speed(strbuf, 256, speed));
+		double speed = (hist.min > 0) ? (double)size / hist.min * 1e9 : 0;		// Bytes/s
+		printf("%10ld\t%10s", size, str_ns(t_str, 32, hist.min));
+		for(int i=0;i<PERCENTILES;i++)
+			printf("\t%10s", str_ns(t_str, 32, hist_percentile(&hist, percentiles[i])));
+		printf("\t%10s\t%-24s\t%6ld\n", str_ns(t_str, 32, hist.max), str_speed(strbuf, 256, speed), run_faults);
 		if(speed > max_speed) max_speed = speed;
 	}
 	
 	printf("Maximum throughput: %s\n", str_speed(strbuf, 256, max_speed));
 
 	// Close socket
-	char msg[8];
-	sprintf(msg, "CLOSE");
-	send(sock, msg, 8, 0);
-	close(sock);
+	if(proto >= 2) print_server_stats(sock);
+	close_session(sock);
+	return 0;
+}
+
+/** One stream of a parallel test. Streams are cache line aligned, as the data path of every
+  * stream updates its counters while the reporter reads them */
+typedef struct {
+	pthread_t tid;
+	test_mode_t mode;			// MODE_ECHO, MODE_SEND or MODE_REVERSE
+	int cpu;					// Pin to this cpu (-1 = no pinning)
+	const char* remote;
+	int port;
+	double *speed;				// Throughput per size in bytes/s
+	cpu_set_t cpus;				// Cpus the stream ran on
+	int sock;					// Connection, set before the stream enters the start barrier
+	uint64_t bytes;				// Transferred bytes, only written by the stream (atomic)
+	hist_t hist;				// Message times of the current size (run_parallel) or the whole run (run_timed)
+} __attribute__((aligned(64))) stream_t;
+
+static pthread_barrier_t streams_barrier;	// Start and end of every size, streams and main thread
+
+/** Connect a stream and open its session, terminates the program on errors */
+static int stream_connect(stream_t *stream) {
+	pin_thread(stream->cpu);
+	const int sock = connect_server(stream->remote, stream->port);
+	if(sock < 0 || open_session(sock) < 0) exit(EXIT_FAILURE);
+	if(stream->mode != MODE_ECHO && proto < 2) {
+		fprintf(stderr, "The server only speaks the legacy protocol, only echo tests are possible\n");
+		exit(EXIT_FAILURE);
+	}
+	CPU_ZERO(&stream->cpus);
+	stream->sock = sock;
+	return sock;
+}
+
+/** One message in the mode of the stream
+  * @returns time in ns or -1 on error */
+static long stream_transfer(const stream_t *stream, const int sock, const long size) {
+	if(stream->mode == MODE_SEND) return send_test(sock, size);
+	else if(stream->mode == MODE_REVERSE) return reverse_test(sock, size);
+	pair_l l = bw_test(sock, size);
+	return (l.f < 0 || l.s < 0) ? -1 : (l.f + l.s) / 2L;
+}
+
+/** Run the size table on one connection in lockstep with the other streams */
+static void * stream_thread(void * args) {
+	stream_t *stream = (stream_t*)args;
+	const int sock = stream_connect(stream);
+
+	const long *bytes;
+	const int nTests = test_sizes(&bytes);
+	for(int i=0;i<nTests;i++) {
+		const long size = bytes[i];
+		pthread_barrier_wait(&streams_barrier);
+		// The main thread merges the histograms between the end of this size and the start of the next
+		hist_reset(&stream->hist);
+		long t_total = 0;
+		for(int j=0;j<iterations;j++) {
+			const long t = stream_transfer(stream, sock, size);
+			if(t < 0) {
+				fprintf(stderr, "error: %s\n", strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+			t_total += t;
+			hist_record(&stream->hist, t);
+			const int cpu = sched_getcpu();
+			if(cpu >= 0) CPU_SET(cpu, &stream->cpus);
+		}
+		stream->speed[i] = (t_total > 0) ? (double)size * iterations / t_total * 1e9 : 0;
+		pthread_barrier_wait(&streams_barrier);
+	}
+	close_session(sock);
+	return NULL;
+}
+
+/** Format the cpus of a cpu set as comma separated list */
+static char* str_cpus(char* buf, size_t size, const cpu_set_t *cpus) {
+	size_t len = 0;
+	buf[0] = '\0';
+	for(int cpu=0;cpu<CPU_SETSIZE && len < size;cpu++) {
+		if(!CPU_ISSET(cpu, cpus)) continue;
+		len += snprintf(buf + len, size - len, (len > 0) ? ",%d" : "%d", cpu);
+	}
+	return buf;
+}
+
+/** Jain's fairness index over the throughput of the streams in the given mode for one size:
+  * 1 if all streams get the same share, 1/n if one stream gets everything
+  * @param sum Set to the aggregate throughput of these streams
+  * @returns fairness index, or -1 if there is no stream in this mode */
+static double fairness(const stream_t *stream, const int n, const test_mode_t mode, const int size_index, double *sum) {
+	double sum_sq = 0;
+	int count = 0;
+	*sum = 0;
+	for(int i=0;i<n;i++) {
+		if(stream[i].mode != mode) continue;
+		const double v = stream[i].speed[size_index];
+		*sum += v;
+		sum_sq += v*v;
+		count++;
+	}
+	if(count == 0) return -1;
+	return (sum_sq > 0) ? (*sum * *sum) / (count * sum_sq) : 0;
+}
+
+/** Create the streams for the configured mode (two per stream in duplex mode) and start them
+  * @param n Set to the number of streams
+  * @param speed Throughput per size and stream, nTests values per stream
+  * @returns streams, to be released with free() */
+static stream_t* streams_start(const char* remote, const int port, int *n, double *speed, const int nTests, void*(*thread)(void*)) {
+	*n = (mode == MODE_DUPLEX) ? streams * 2 : streams;
+	stream_t *stream = NULL;
+	if(posix_memalign((void**)&stream, 64, sizeof(stream_t) * *n) != 0) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	memset(stream, 0, sizeof(stream_t) * *n);
+	const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	pthread_barrier_init(&streams_barrier, NULL, *n + 1);
+	for(int i=0;i<*n;i++) {
+		if(mode == MODE_DUPLEX) stream[i].mode = (i % 2 == 0) ? MODE_SEND : MODE_REVERSE;
+		else stream[i].mode = mode;
+		stream[i].cpu = (pin_cpu >= 0 && cpus > 0) ? (int)((pin_cpu + i) % cpus) : -1;
+		stream[i].remote = remote;
+		stream[i].port = port;
+		stream[i].speed = (speed != NULL) ? speed + (size_t)i * nTests : NULL;
+		int rc = pthread_create(&stream[i].tid, NULL, thread, &stream[i]);
+		if(rc != 0) {
+			fprintf(stderr, "error creating stream thread: %s\n", strerror(rc));
+			exit(EXIT_FAILURE);
+		}
+	}
+	return stream;
+}
+
+/** Bandwidth test with multiple parallel streams. Every stream runs on its own connection and thread,
+  * all streams test the same size at the same time. In echo mode this reports the aggregate throughput,
+  * the slowest and fastest stream and Jain's fairness index over the streams per size. In the
+  * directional modes upload and download throughput (sum over the streams of that direction) and
+  * their fairness are reported separately. Duplex runs a send and a reverse stream for every stream */
+int run_parallel(const char* remote, const int port) {
+	const long *bytes;
+	const int nTests = test_sizes(&bytes);
+	int n;
+	double *speed = (double*)calloc((size_t)streams * 2 * nTests, sizeof(double));
+	if(speed == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return -1;
+	}
+	stream_t *stream = streams_start(remote, port, &n, speed, nTests, stream_thread);
+
+	printf("Running %d tests with %d iterations each on %d streams\n\n", nTests, iterations, n);
+	if(mode == MODE_ECHO)
+		printf("%10s\t%-24s\t%-24s\t%-24s\t%s","Size", "aggregate", "slowest stream", "fastest stream", "fairness");
+	else
+		printf("%10s\t%-24s\t%-24s\t%s","Size", "upload", "download", "fairness (up down)");
+	printf("\t%10s\t%10s\t%10s\n", "p50", "p99", "p99.9");
+	static hist_t merged;
+	double max_speed = 0, max_up = 0, max_down = 0;
+	char strbuf[3][256];
+	for(int i=0;i<nTests;i++) {
+		pthread_barrier_wait(&streams_barrier);
+		const uint64_t t1 = time_ns();
+		pthread_barrier_wait(&streams_barrier);
+		const uint64_t t_ns = time_ns() - t1;
+		hist_reset(&merged);
+		for(int j=0;j<n;j++) hist_merge(&merged, &stream[j].hist);
+
+		if(mode == MODE_ECHO) {
+			double sum, min = 0, max = 0;
+			for(int j=0;j<n;j++) {
+				const double v = stream[j].speed[i];
+				if(j == 0 || v < min) min = v;
+				if(j == 0 || v > max) max = v;
+			}
+			const double fair = fairness(stream, n, MODE_ECHO, i, &sum);
+			const double aggregate = (t_ns > 0) ? (double)bytes[i] * iterations * n / (t_ns / 2.0) * 1e9 : 0;
+			printf("%10ld\t%-24s\t%-24s\t%-24s\t%.3f", bytes[i], str_speed(strbuf[0], 256, aggregate), str_speed(strbuf[1], 256, min), str_speed(strbuf[2], 256, max), fair);
+			if(aggregate > max_speed) max_speed = aggregate;
+		} else {
+			// Streams of one direction run concurrently, so their throughput adds up
+			double up, down;
+			const double fair_up = fairness(stream, n, MODE_SEND, i, &up);
+			const double fair_down = fairness(stream, n, MODE_REVERSE, i, &down);
+			if(fair_up >= 0) str_speed(strbuf[0], 256, up);
+			else snprintf(strbuf[0], 256, "-");
+			if(fair_down >= 0) str_speed(strbuf[1], 256, down);
+			else snprintf(strbuf[1], 256, "-");
+			printf("%10ld\t%-24s\t%-24s\t", bytes[i], strbuf[0], strbuf[1]);
+			if(fair_up >= 0) printf("%.3f ", fair_up);
+			else printf("  -   ");
+			if(fair_down >= 0) printf("%.3f", fair_down);
+			else printf("  -  ");
+			if(up > max_up) max_up = up;
+			if(down > max_down) max_down = down;
+		}
+		// Message times of all streams (in duplex mode of both directions)
+		char t_str[3][32];
+		printf("\t%10s\t%10s\t%10s\n", str_ns(t_str[0], 32, hist_percentile(&merged, 50)), str_ns(t_str[1], 32, hist_percentile(&merged, 99)), str_ns(t_str[2], 32, hist_percentile(&merged, 99.9)));
+	}
+	if(mode == MODE_ECHO)
+		printf("Maximum aggregate throughput: %s\n\n", str_speed(strbuf[0], 256, max_speed));
+	else {
+		if(mode != MODE_REVERSE) printf("Maximum upload throughput:   %s\n", str_speed(strbuf[0], 256, max_up));
+		if(mode != MODE_SEND) printf("Maximum download throughput: %s\n", str_speed(strbuf[0], 256, max_down));
+		printf("\n");
+	}
+
+	for(int i=0;i<n;i++) {
+		pthread_join(stream[i].tid, NULL);
+		double stream_max = 0;
+		for(int j=0;j<nTests;j++)
+			if(stream[i].speed[j] > stream_max) stream_max = stream[i].speed[j];
+		const char* dir = (stream[i].mode == MODE_SEND) ? "upload" : (stream[i].mode == MODE_REVERSE) ? "download" : "echo";
+		printf("Stream %3d: maximum %s %s on cpu %s\n", i, dir, str_speed(strbuf[0], 256, stream_max), str_cpus(strbuf[1], 256, &stream[i].cpus));
+	}
+	pthread_barrier_destroy(&streams_barrier);
+	free(speed);
+	free(stream);
+	return 0;
+}
+
+/** Duration based stream: Transfer messages until the test is over and publish the transferred bytes */
+static void * timed_thread(void * args) {
+	stream_t *stream = (stream_t*)args;
+	const int sock = stream_connect(stream);
+	const long size = (test_size > 0) ? test_size : TIMED_SIZE;
+	// An echo moves the message in both directions
+	const uint64_t per_message = (stream->mode == MODE_ECHO) ? 2 * (uint64_t)size : (uint64_t)size;
+	uint64_t bytes = 0;
+
+	pthread_barrier_wait(&streams_barrier);
+	while(__atomic_load_n(&timed_running, __ATOMIC_RELAXED)) {
+		const long t = stream_transfer(stream, sock, size);
+		if(t < 0) {
+			fprintf(stderr, "error: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		hist_record(&stream->hist, t);
+		bytes += per_message;
+		// Single writer, the reporter only needs an untorn value
+		__atomic_store_n(&stream->bytes, bytes, __ATOMIC_RELAXED);
+		const int cpu = sched_getcpu();
+		if(cpu >= 0) CPU_SET(cpu, &stream->cpus);
+	}
+	close_session(sock);
+	return NULL;
+}
+
+/** Seconds on the monotonic clock */
+static double now_s() {
+	return time_ns() * 1e-9;
+}
+
+/** Duration based test (-t) with interval reports (-i). The calling thread is the reporter: It sleeps
+  * until the end of every interval and samples the byte counters of the streams and the TCP_INFO
+  * (smoothed rtt, retransmits) of their sockets, without ever locking the data path */
+int run_timed(const char* remote, const int port) {
+	int n;
+	stream_t *stream = streams_start(remote, port, &n, NULL, 0, timed_thread);
+	static hist_t merged;
+	uint64_t *last_bytes = (uint64_t*)calloc(n, sizeof(uint64_t));
+	uint32_t *last_retrans = (uint32_t*)calloc(n, sizeof(uint32_t));
+	if(last_bytes == NULL || last_retrans == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return -1;
+	}
+
+	__atomic_store_n(&timed_running, true, __ATOMIC_RELAXED);
+	pthread_barrier_wait(&streams_barrier);
+	const double t_start = now_s();
+	printf("Running for %.1f seconds on %d streams\n\n", duration_s, n);
+	printf("%15s\t%-10s\t%-24s\t%8s\t%s\n", "Interval", "Transfer", "Throughput", "RTT", "Retr");
+	char strbuf[256];
+	double t_last = t_start;
+	uint64_t total = 0, total_retrans = 0;
+	while(t_last - t_start < duration_s - 1e-6) {
+		double t_next = t_last + interval_s;
+		if(t_next > t_start + duration_s) t_next = t_start + duration_s;
+		const double wait = t_next - now_s();
+		if(wait > 0) {
+			struct timespec ts;
+			ts.tv_sec = (time_t)wait;
+			ts.tv_nsec = (long)((wait - (double)ts.tv_sec) * 1e9);
+			while(nanosleep(&ts, &ts) < 0 && errno == EINTR);
+		}
+		const double t_now = now_s();
+
+		uint64_t bytes = 0, retrans = 0;
+		double rtt = 0;
+		for(int i=0;i<n;i++) {
+			const uint64_t b = __atomic_load_n(&stream[i].bytes, __ATOMIC_RELAXED);
+			bytes += b - last_bytes[i];
+			last_bytes[i] = b;
+			struct tcp_info info;
+			socklen_t len = sizeof(info);
+			if(getsockopt(stream[i].sock, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+				rtt += info.tcpi_rtt / (double)n;
+				retrans += info.tcpi_total_retrans - last_retrans[i];
+				last_retrans[i] = info.tcpi_total_retrans;
+			}
+		}
+		total += bytes;
+		total_retrans += retrans;
+		printf("%6.1f-%6.1f s\t%7.1f MB\t%-24s\t%5.0f µs\t%lu\n", t_last - t_start, t_now - t_start, bytes / (1024.0*1024.0), str_speed(strbuf, 256, bytes / (t_now - t_last)), rtt, retrans);
+		fflush(stdout);
+		t_last = t_now;
+	}
+	__atomic_store_n(&timed_running, false, __ATOMIC_RELAXED);
+	printf("%6.1f-%6.1f s\t%7.1f MB\t%-24s\t%8s\t%lu  total\n\n", 0.0, t_last - t_start, total / (1024.0*1024.0), str_speed(strbuf, 256, total / (t_last - t_start)), "", total_retrans);
+
+	for(int i=0;i<n;i++) {
+		pthread_join(stream[i].tid, NULL);
+		const char* dir = (stream[i].mode == MODE_SEND) ? "upload" : (stream[i].mode == MODE_REVERSE) ? "download" : "echo";
+		printf("Stream %3d: %s %.1f MB on cpu %s\n", i, dir, stream[i].bytes / (1024.0*1024.0), str_cpus(strbuf, 256, &stream[i].cpus));
+		hist_merge(&merged, &stream[i].hist);
+	}
+	printf("Message time (%lu messages): %s\n", merged.count, str_hist(strbuf, 256, &merged));
+	pthread_barrier_destroy(&streams_barrier);
+	free(last_retrans);
+	free(last_bytes);
+	free(stream);
+	return 0;
+}
+
+/** Sleep (coarse) and spin (fine) until the given time_ns() */
+static void pace_until(const uint64_t target) {
+	uint64_t now = time_ns();
+	if(now >= target) return;
+	// Sleeping is only precise to some 50 µs, spin for the rest. The sleep is relative,
+	// time_ns() does not need to be on the clock of clock_nanosleep (TSC)
+	if(target - now > 100000UL) {
+		const uint64_t sleep = target - now - 50000UL;
+		struct timespec ts;
+		ts.tv_sec = (time_t)(sleep / 1000000000UL);
+		ts.tv_nsec = (long)(sleep % 1000000000UL);
+		while(nanosleep(&ts, &ts) < 0 && errno == EINTR);
+	}
+	do {
+		now = time_ns();
+	} while(now < target);
+}
+
+/** Udp bandwidth test: The server opens a udp port on request over the control connection, the
+  * client sends sequence numbered and timestamped datagrams at the target rate to it and the
+  * server reports what arrived. Datagrams are sent in batches with sendmmsg, every batch is
+  * released at its scheduled time, so a batch covers at most some 50 µs of the target rate */
+int run_udp(const char* remote, const int port) {
+	const int sock = connect_server(remote, port);
+	if(sock < 0) exit(EXIT_FAILURE);
+	pin_thread(pin_cpu);
+	if(open_session(sock) < 0) {
+		close(sock);
+		return -1;
+	}
+	if(proto < 2) {
+		fprintf(stderr, "The udp test needs a protocol v2 server\n");
+		close_session(sock);
+		return -1;
+	}
+	frame_t reply;
+	uint64_t udp_port;
+	if(request(sock, FRAME_UDP, 0, &reply) < 0 || reply.len != 8 || recv_all(sock, &udp_port, 8) < 8) {
+		fprintf(stderr, "udp request failed: %s\n", strerror(errno));
+		close_session(sock);
+		return -1;
+	}
+	udp_port = be64toh(udp_port);
+
+	const int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	struct sockaddr_in addr;
+	bzero(&addr, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons((uint16_t)udp_port);
+	addr.sin_addr.s_addr = inet_addr(remote);
+	if(fd < 0 || connect(fd, (const struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "udp socket failed: %s\n", strerror(errno));
+		close_session(sock);
+		return -1;
+	}
+	int sndbuf = 4*1024*1024;
+	if(setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) < 0)
+		fprintf(stderr, "Warning: Failed to set SO_SNDBUF: %s\n", strerror(errno));
+
+	const double duration = (duration_s > 0) ? duration_s : 10.0;
+	const double interval_ns = udp_size * 8.0 / udp_rate * 1e9;
+	int batch = (int)(50000.0 / interval_ns);
+	if(batch < 1) batch = 1;
+	if(batch > UDP_BATCH) batch = UDP_BATCH;
+	unsigned char *buf = calloc(UDP_BATCH, udp_size);
+	if(buf == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return -1;
+	}
+	struct mmsghdr msgs[UDP_BATCH];
+	struct iovec iovs[UDP_BATCH];
+	for(int i=0;i<UDP_BATCH;i++) {
+		iovs[i].iov_base = buf + (size_t)i * udp_size;
+		iovs[i].iov_len = udp_size;
+		bzero(&msgs[i], sizeof(msgs[i]));
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	char strbuf[256];
+	printf("Udp test: %s target rate, %d bytes datagrams, %.1f seconds (batches of %d)\n", str_rate(strbuf, 256, udp_rate), udp_size, duration, batch);
+	const uint64_t t0 = time_ns();
+	const uint64_t total = (uint64_t)(duration * 1e9 / interval_ns);
+	uint64_t sent = 0, errors = 0;
+	while(sent < total) {
+		pace_until(t0 + (uint64_t)(sent * interval_ns));
+		int n = (total - sent < (uint64_t)batch) ? (int)(total - sent) : batch;
+		const uint64_t ts_tx = htobe64(now_ns());
+		for(int i=0;i<n;i++) {
+			const uint64_t seq_tx = htobe64(sent + i);
+			memcpy(buf + (size_t)i * udp_size, &seq_tx, 8);
+			memcpy(buf + (size_t)i * udp_size + 8, &ts_tx, 8);
+		}
+		int rc = sendmmsg(fd, msgs, n, 0);
+		if(rc < 0) {
+			// ENOBUFS/ECONNREFUSED: Count the batch as sent and lost and go on, EINTR retries
+			if(errno != EINTR) {
+				errors++;
+				sent += n;
+			}
+			continue;
+		}
+		sent += rc;
+	}
+	const double elapsed = (time_ns() - t0) * 1e-9;
+	close(fd);
+	free(buf);
+
+	uint64_t values[UDP_RESULTS];
+	bzero(values, sizeof(values));
+	if(request(sock, FRAME_UDP_END, 0, &reply) < 0) {
+		fprintf(stderr, "udp end failed: %s\n", strerror(errno));
+		close_session(sock);
+		return -1;
+	}
+	for(uint64_t i=0;i<reply.len;i+=8) {
+		uint64_t value;
+		if(recv_all(sock, &value, 8) < 8) {
+			fprintf(stderr, "udp results failed: %s\n", strerror(errno));
+			close_session(sock);
+			return -1;
+		}
+		if(i/8 < UDP_RESULTS) values[i/8] = be64toh(value);
+	}
+	close_session(sock);
+
+	const uint64_t unique = values[UDP_RECEIVED] - values[UDP_DUPLICATES];
+	const uint64_t lost = (sent > unique) ? sent - unique : 0;
+	const double rx_duration = values[UDP_DURATION] * 1e-9;
+	printf("  Sent       : %lu datagrams, %s", sent, str_rate(strbuf, 256, sent * udp_size * 8.0 / elapsed));
+	if(errors > 0) printf(", %lu send errors", errors);
+	printf("\n");
+	printf("  Delivered  : %lu datagrams, %s\n", values[UDP_RECEIVED], str_rate(strbuf, 256, (rx_duration > 0) ? values[UDP_BYTES] * 8.0 / rx_duration : 0));
+	printf("  Loss       : %lu (%.3f %%)\n", lost, (sent > 0) ? 100.0 * lost / sent : 0);
+	printf("  Duplicates : %lu\n", values[UDP_DUPLICATES]);
+	printf("  Reordered  : %lu (max depth %lu)\n", values[UDP_REORDERED], values[UDP_REORDER_DEPTH]);
+	printf("  Jitter     : %.1f µs\n", values[UDP_JITTER] * 1e-3);
+	return 0;
+}
+
+/** State of an open-loop test, shared by the sender and the receiver */
+typedef struct {
+	int sock;
+	uint64_t t0;				// time_ns() of the intended send time of the first request
+	double interval_ns;			// Schedule: Request k is due at t0 + k * interval_ns
+	uint64_t total;				// Number of requests
+	uint64_t max_lag;			// Sender: Largest delay behind the schedule in ns
+} open_loop_t;
+
+/** Open-loop sender: Issue the PING requests on schedule, without waiting for any reply. If the
+  * sender falls behind (e.g. a full socket buffer), it sends the overdue requests at once */
+static void * open_loop_sender(void * args) {
+	open_loop_t *test = (open_loop_t*)args;
+	if(pin_cpu >= 0) pin_thread(pin_cpu + 1);
+	frame_t req;
+	bzero(&req, sizeof(req));
+	req.type = FRAME_PING;
+	for(uint64_t k=0;k<test->total;k++) {
+		const uint64_t due = test->t0 + (uint64_t)(k * test->interval_ns);
+		pace_until(due);
+		const uint64_t lag = time_ns() - due;
+		if(lag > test->max_lag) test->max_lag = lag;
+		// The sequence number identifies the request, so the receiver knows its intended send time
+		req.seq = k + 1;
+		req.ts = now_ns();
+		if(send_frame(test->sock, &req) < 0) {
+			fprintf(stderr, "send failed: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+	return NULL;
+}
+
+/** Open-loop latency test (protocol v2): A sender thread issues PING requests at a fixed rate
+  * regardless of outstanding replies, the calling thread receives the replies and matches them
+  * by their sequence number. The latency is taken from the intended send time, so a stall counts
+  * for every request that should have been sent during it (no coordinated omission). For
+  * comparison the service time is taken from the actual send time (sender timestamp in the reply) */
+int run_open_loop(const char* remote, const int port) {
+	const int sock = connect_server(remote, port);
+	if(sock < 0) exit(EXIT_FAILURE);
+	pin_thread(pin_cpu);
+	if(open_session(sock) < 0) {
+		close(sock);
+		return -1;
+	}
+	if(proto < 2) {
+		fprintf(stderr, "The open-loop test needs a protocol v2 server\n");
+		close_session(sock);
+		return -1;
+	}
+	const double duration = (duration_s > 0) ? duration_s : 10.0;
+	open_loop_t test;
+	bzero(&test, sizeof(test));
+	test.sock = sock;
+	test.interval_ns = 1e9 / open_rate;
+	test.total = (uint64_t)(duration * open_rate);
+	if(test.total < 1) test.total = 1;
+
+	static hist_t latency, service;
+	hist_reset(&latency);
+	hist_reset(&service);
+	char strbuf[256];
+	printf("Open loop: %.0f requests/s for %.1f seconds (%lu requests)\n", open_rate, duration, test.total);
+
+	pthread_t sender;
+	test.t0 = time_ns();
+	int rc = pthread_create(&sender, NULL, open_loop_sender, &test);
+	if(rc != 0) {
+		fprintf(stderr, "error creating sender thread: %s\n", strerror(rc));
+		exit(EXIT_FAILURE);
+	}
+	for(uint64_t received = 0; received < test.total; received++) {
+		frame_t reply;
+		rc = recv_frame(sock, &reply);
+		if(rc == 0) errno = ECONNRESET;
+		if(rc <= 0) {
+			fprintf(stderr, "recv failed: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		const uint64_t now = time_ns();
+		if(reply.type != FRAME_PONG || reply.seq < 1 || reply.seq > test.total) {
+			fprintf(stderr, "Illegal reply (type %u, seq %lu)\n", reply.type, reply.seq);
+			exit(EXIT_FAILURE);
+		}
+		const uint64_t due = test.t0 + (uint64_t)((reply.seq - 1) * test.interval_ns);
+		hist_record(&latency, (now > due) ? (long)(now - due) : 0);
+		const uint64_t now_rt = now_ns();
+		hist_record(&service, (now_rt > reply.ts) ? (long)(now_rt - reply.ts) : 0);
+	}
+	const double elapsed = (time_ns() - test.t0) * 1e-9;
+	pthread_join(sender, NULL);
+
+	printf("  Achieved   : %.0f requests/s, sender at most %s behind schedule\n", test.total / elapsed, str_ns(strbuf, 256, test.max_lag));
+	printf("  Latency    : %s\n", str_hist(strbuf, 256, &latency));
+	printf("  Service    : %s\n", str_hist(strbuf, 256, &service));
+	print_server_stats(sock);
+	close_session(sock);
+	return 0;
+}
+
+/* ==== Connection scalability load test ==================================== */
+
+typedef enum {
+	CONN_CONNECTING = 1,	// Non-blocking connect in progress
+	CONN_IDLE,				// Established, waiting for the next keepalive
+	CONN_WAITING,			// Keepalive ping sent, waiting for the reply
+	CONN_CLOSED,			// Failed, rejected or closed by the server
+} conn_state_t;
+
+/** One connection of the load test */
+typedef struct {
+	int fd;
+	int next;				// Next connection in the same keepalive slot (-1 = end of the list)
+	uint8_t state;			// conn_state_t
+	uint8_t got;			// Bytes of the current reply
+	char reply[8];
+	uint64_t t_sent;		// time_ns() of the connect or the last ping
+} conn_t;
+
+/** Counters of the load test */
+typedef struct {
+	uint64_t opened;		// Connects started
+	uint64_t established;	// Currently established connections
+	uint64_t failed;		// Failed connects (including socket errors)
+	int last_errno;			// Reason of the last failed connect
+	uint64_t rejected;		// Connections the server answered with BUSY
+	uint64_t dropped;		// Established connections closed by the server or with an error
+	uint64_t pings;			// Keepalive pings sent
+	uint64_t late;			// Keepalives that were due while the previous ping was still unanswered
+} load_t;
+
+/** Resident memory of the server in bytes, from the STATS of the control session (bw server) or
+  * from the metrics endpoint on REMOTE:--metrics (echod, echod_resident_bytes)
+  * @returns resident bytes or -1 if unknown */
+static long server_rss(const char* remote, const int ctl) {
+	if(metrics_port > 0) {
+		const int fd = connect_server(remote, metrics_port);
+		if(fd < 0) return -1;
+		const char* req = "GET /metrics HTTP/1.0\r\n\r\n";
+		char buf[8192];
+		size_t len = 0;
+		if(send_all(fd, req, strlen(req)) < 0) len = 0;
+		else {
+			ssize_t rc;
+			while(len < sizeof(buf)-1 && (rc = recv(fd, buf + len, sizeof(buf)-1-len, 0)) > 0) len += (size_t)rc;
+		}
+		close(fd);
+		buf[len] = '\0';
+		const char* value = strstr(buf, "\nechod_resident_bytes ");
+		return (value != NULL) ? atol(value + strlen("\nechod_resident_bytes ")) : -1;
+	} else if(ctl >= 0 && proto >= 2) {
+		uint64_t values[STATS_COUNT];
+		if(server_stats(ctl, values) < 0) return -1;
+		return (long)values[STAT_RSS];
+	}
+	return -1;
+}
+
+/** Close a load test connection and update the counters */
+static void conn_close(conn_t *conn, load_t *load) {
+	if(conn->state == CONN_IDLE || conn->state == CONN_WAITING) load->established--;
+	close(conn->fd);
+	conn->fd = -1;
+	conn->state = CONN_CLOSED;
+}
+
+/** Start the non-blocking connect of a load test connection
+  * @returns 0 if the connect is in progress or complete, -1 on error */
+static int conn_open(conn_t *conn, const int epfd, const struct sockaddr_in *addr, const int index) {
+	conn->state = CONN_CLOSED;
+	conn->next = -1;
+	conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(conn->fd < 0) return -1;
+	int one = 1;
+	setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	conn->t_sent = time_ns();
+	if(connect(conn->fd, (const struct sockaddr*)addr, sizeof(*addr)) < 0 && errno != EINPROGRESS) goto fail;
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+	ev.data.u32 = (uint32_t)index;
+	if(epoll_ctl(epfd, EPOLL_CTL_ADD, conn->fd, &ev) < 0) goto fail;
+	conn->state = CONN_CONNECTING;
+	return 0;
+fail:
+	{
+		const int err = errno;
+		close(conn->fd);
+		conn->fd = -1;
+		errno = err;
+	}
+	return -1;
+}
+
+/** Load test: Ramp up --connections connections at --ramp connections/s from a single event
+  * driven thread (non-blocking sockets, epoll), keep them alive with small pings every --keepalive
+  * ms and hold them for -t seconds. Every -i seconds the number of connections and the ping round
+  * trip percentiles are reported. The pings are legacy PINGs, which the bw server answers with
+  * PONG and echod echoes. Keepalives are scheduled on a timing wheel with one slot per ms of the
+  * keepalive interval, every connection stays in its slot, so scheduling is O(1) per ping */
+int run_load(const char* remote, const int port) {
+	const int n = load_connections;
+	const int slots = (keepalive_ms > 0) ? keepalive_ms : 1;
+	const double hold = (duration_s > 0) ? duration_s : 10.0;
+
+	// Every connection needs a file descriptor
+	struct rlimit limit;
+	if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+	if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t)n + 16)
+		fprintf(stderr, "Warning: Only %lu file descriptors available, raise ulimit -n\n", (unsigned long)limit.rlim_cur);
+
+	// The control session is opened before the load, so that it never gets a BUSY reply
+	int ctl = -1;
+	if(metrics_port <= 0) {
+		ctl = connect_server(remote, port);
+		if(ctl < 0) exit(EXIT_FAILURE);
+		if(open_session(ctl) < 0) {
+			close(ctl);
+			return -1;
+		}
+		if(proto < 2) fprintf(stderr, "Warning: Legacy server, the server memory is unknown (echod: use --metrics)\n");
+	}
+	const long rss_start = server_rss(remote, ctl);
+
+	conn_t *conns = (conn_t*)calloc(n, sizeof(conn_t));
+	int *wheel = (int*)malloc(sizeof(int) * slots);
+	const int max_events = 1024;
+	struct epoll_event *events = (struct epoll_event*)malloc(sizeof(struct epoll_event) * max_events);
+	const int epfd = epoll_create1(EPOLL_CLOEXEC);
+	if(conns == NULL || wheel == NULL || events == NULL || epfd < 0) {
+		fprintf(stderr, "Cannot set up the load test: %s\n", strerror(errno));
+		return -1;
+	}
+	for(int i=0;i<slots;i++) wheel[i] = -1;
+	struct sockaddr_in addr;
+	bzero(&addr, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = inet_addr(remote);
+
+	static hist_t rtt, rtt_total, connect_time;
+	hist_reset(&rtt);
+	hist_reset(&rtt_total);
+	hist_reset(&connect_time);
+	load_t load;
+	bzero(&load, sizeof(load));
+	char strbuf[4][32];
+
+	printf("Load test: %d connections at %.0f connections/s, keepalive every %d ms, hold for %.1f seconds\n\n", n, load_ramp, slots, hold);
+	printf("%8s\t%8s\t%8s\t%8s\t%8s\t%10s\t%10s\t%10s\t%10s\n", "Time", "Conns", "Failed", "Dropped", "Pings", "p50", "p99", "p99.9", "max");
+	const uint64_t t0 = time_ns();
+	uint64_t last_ms = 0;				// Last keepalive slot processed (ms since t0)
+	uint64_t next_report = t0 + (uint64_t)(interval_s * 1e9);
+	uint64_t hold_end = 0;				// Set once the last connect has been started
+	int connecting = 0;
+	while(true) {
+		uint64_t now = time_ns();
+
+		// Ramp up
+		while(load.opened < (uint64_t)n && (double)load.opened < (now - t0) * 1e-9 * load_ramp) {
+			const int i = (int)load.opened++;
+			if(conn_open(&conns[i], epfd, &addr, i) < 0) {
+				load.failed++;
+				load.last_errno = errno;
+			} else
+				connecting++;
+		}
+		if(hold_end == 0 && load.opened == (uint64_t)n)
+			hold_end = now + (uint64_t)(hold * 1e9);
+
+		// Keepalives of all slots that became due since the last round, at most one full turn
+		const uint64_t now_ms = (now - t0) / 1000000UL;
+		if(now_ms - last_ms > (uint64_t)slots) last_ms = now_ms - slots;
+		for(; last_ms < now_ms; last_ms++) {
+			for(int i = wheel[(last_ms + 1) % slots]; i >= 0; i = conns[i].next) {
+				conn_t *conn = &conns[i];
+				if(conn->state == CONN_WAITING) load.late++;
+				if(conn->state != CONN_IDLE) continue;
+				conn->t_sent = now;
+				if(send(conn->fd, "PING    ", 8, MSG_DONTWAIT | MSG_NOSIGNAL) != 8) {
+					load.dropped++;
+					conn_close(conn, &load);
+					continue;
+				}
+				conn->state = CONN_WAITING;
+				load.pings++;
+			}
+		}
+
+		const int rc = epoll_wait(epfd, events, max_events, 1);
+		if(rc < 0 && errno != EINTR) {
+			fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		now = time_ns();
+		for(int e=0;e<rc;e++) {
+			const int i = (int)events[e].data.u32;
+			conn_t *conn = &conns[i];
+			const uint32_t revents = events[e].events;
+			if(conn->state == CONN_CONNECTING) {
+				int err = 0;
+				socklen_t len = sizeof(err);
+				if(getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) err = errno;
+				if(err == 0 && !(revents & (EPOLLOUT | EPOLLIN))) continue;
+				connecting--;
+				if(err != 0 || (revents & EPOLLERR)) {
+					load.failed++;
+					load.last_errno = (err != 0) ? err : ECONNRESET;
+					conn_close(conn, &load);
+					continue;
+				}
+				hist_record(&connect_time, (long)(now - conn->t_sent));
+				struct epoll_event ev;
+				ev.events = EPOLLIN | EPOLLRDHUP;
+				ev.data.u32 = (uint32_t)i;
+				epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+				conn->state = CONN_IDLE;
+				load.established++;
+				// Connections are spread evenly over the keepalive slots
+				conn->next = wheel[i % slots];
+				wheel[i % slots] = i;
+				if(!(revents & EPOLLIN)) continue;
+			}
+			if(conn->state != CONN_IDLE && conn->state != CONN_WAITING) continue;
+			if(revents & EPOLLIN) {
+				ssize_t len = recv(conn->fd, conn->reply + conn->got, 8 - conn->got, MSG_DONTWAIT);
+				if(len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) continue;
+				if(len <= 0) {
+					load.dropped++;
+					conn_close(conn, &load);
+					continue;
+				}
+				conn->got += (uint8_t)len;
+				if(conn->got < 8) continue;
+				conn->got = 0;
+				if(!strncmp("BUSY", conn->reply, 4)) {
+					load.rejected++;
+					conn_close(conn, &load);
+					continue;
+				}
+				if(conn->state == CONN_WAITING) {
+					hist_record(&rtt, (long)(now - conn->t_sent));
+					conn->state = CONN_IDLE;
+				}
+			} else if(revents & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+				load.dropped++;
+				conn_close(conn, &load);
+			}
+		}
+
+		if(now >= next_report || (hold_end > 0 && now >= hold_end)) {
+			printf("%6.1f s\t%8lu\t%8lu\t%8lu\t%8lu\t%10s\t%10s\t%10s\t%10s\n", (now - t0) * 1e-9, load.established, load.failed + load.rejected, load.dropped, load.pings,
+				str_ns(strbuf[0], 32, hist_percentile(&rtt, 50)), str_ns(strbuf[1], 32, hist_percentile(&rtt, 99)), str_ns(strbuf[2], 32, hist_percentile(&rtt, 99.9)), str_ns(strbuf[3], 32, rtt.max));
+			fflush(stdout);
+			hist_merge(&rtt_total, &rtt);
+			hist_reset(&rtt);
+			next_report += (uint64_t)(interval_s * 1e9);
+		}
+		if(hold_end > 0 && now >= hold_end) break;
+	}
+	const long rss_end = server_rss(remote, ctl);
+	const uint64_t established = load.established;
+	for(int i=0;i<n;i++)
+		if(conns[i].state != CONN_CLOSED && conns[i].fd >= 0) conn_close(&conns[i], &load);
+	close(epfd);
+
+	char buf[256];
+	printf("\n");
+	printf("  Connections : %lu established, %lu failed", established, load.failed);
+	if(load.failed > 0) printf(" (%s)", strerror(load.last_errno));
+	printf(", %lu rejected (BUSY), %lu dropped", load.rejected, load.dropped);
+	if(connecting > 0) printf(", %d still connecting", connecting);
+	printf("\n");
+	printf("  Connect     : %s\n", str_hist(buf, 256, &connect_time));
+	printf("  Keepalive   : %lu pings, %lu late\n", load.pings, load.late);
+	printf("  Ping        : %s\n", str_hist(buf, 256, &rtt_total));
+	if(rss_start >= 0 && rss_end >= 0) {
+		const long grown = rss_end - rss_start;
+		printf("  Server      : %.1f MB resident (%+.1f MB), %.1f KB per connection\n", rss_end / (1024.0*1024.0), grown / (1024.0*1024.0), (established > 0) ? grown / 1024.0 / established : 0);
+	}
+	if(ctl >= 0) close_session(ctl);
+	free(events);
+	free(wheel);
+	free(conns);
+	return 0;
+}
+
+/** Pipelined pings at one depth: Keep depth PING requests in flight for the given time, every
+  * reply is answered with the next request
+  * @returns achieved messages/s or -1 on error */
+static double depth_test(const int sock, const int depth, const double duration, uint64_t *sent_at, hist_t *hist) {
+	frame_t req;
+	bzero(&req, sizeof(req));
+	req.type = FRAME_PING;
+	const uint64_t t0 = time_ns();
+	const uint64_t t_end = t0 + (uint64_t)(duration * 1e9);
+	const uint64_t first = seq + 1;
+	uint64_t replies = 0, t_stop = 0;
+	for(int i=0;i<depth;i++) {
+		req.seq = ++seq;
+		req.ts = now_ns();
+		sent_at[req.seq % depth] = time_ns();
+		if(send_frame(sock, &req) < 0) return -1;
+	}
+	// Replies come in order, so the reply to seq frees the slot of seq for seq + depth
+	uint64_t expected = first;
+	bool sending = true;
+	while(expected <= seq) {
+		frame_t reply;
+		int rc = recv_frame(sock, &reply);
+		if(rc == 0) errno = ECONNRESET;
+		if(rc <= 0) return -1;
+		const uint64_t now = time_ns();
+		if(reply.type != FRAME_PONG || reply.seq != expected) {
+			errno = EPROTO;
+			return -1;
+		}
+		expected++;
+		if(!sending) continue;
+		hist_record(hist, (long)(now - sent_at[reply.seq % depth]));
+		replies++;
+		if(now >= t_end) {
+			// Only the replies during the test count, the remaining ones are drained
+			sending = false;
+			t_stop = now;
+			continue;
+		}
+		req.seq = ++seq;
+		req.ts = now_ns();
+		sent_at[req.seq % depth] = time_ns();
+		if(send_frame(sock, &req) < 0) return -1;
+	}
+	const double elapsed = (t_stop - t0) * 1e-9;
+	return (elapsed > 0) ? replies / elapsed : 0;
+}
+
+/** Pipelined ping test (protocol v2): Keep --depth requests in flight on one connection for -t
+  * seconds (default: 1) and report the achieved messages/s and the latency distribution. With
+  * --depth sweep the test runs for the depths 1, 2, 4 ... MAX_DEPTH */
+int run_depth(const char* remote, const int port) {
+	const int sock = connect_server(remote, port);
+	if(sock < 0) exit(EXIT_FAILURE);
+	pin_thread(pin_cpu);
+	if(open_session(sock) < 0) {
+		close(sock);
+		return -1;
+	}
+	if(proto < 2) {
+		fprintf(stderr, "The pipelined ping test needs a protocol v2 server\n");
+		close_session(sock);
+		return -1;
+	}
+	const double duration = (duration_s > 0) ? duration_s : 1.0;
+	const int max_depth = (depth > 0) ? depth : MAX_DEPTH;
+	uint64_t *sent_at = (uint64_t*)calloc(max_depth, sizeof(uint64_t));
+	if(sent_at == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return -1;
+	}
+	static hist_t hist;
+	char t_str[32];
+
+	printf("Pipelined pings, %.1f seconds per depth\n\n", duration);
+	printf("%6s\t%12s\t%10s", "Depth", "Messages/s", "t_min");
+	for(int i=0;i<PERCENTILES;i++) {
+		snprintf(t_str, 32, "p%g", percentiles[i]);
+		printf("\t%10s", t_str);
+	}
+	printf("\t%10s\n", "t_max");
+	for(int d = (depth > 0) ? depth : 1; d <= max_depth; d *= 2) {
+		hist_reset(&hist);
+		const double rate = depth_test(sock, d, duration, sent_at, &hist);
+		if(rate < 0) {
+			fprintf(stderr, "error: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		printf("%6d\t%12.0f\t%10s", d, rate, str_ns(t_str, 32, hist.min));
+		for(int i=0;i<PERCENTILES;i++)
+			printf("\t%10s", str_ns(t_str, 32, hist_percentile(&hist, percentiles[i])));
+		printf("\t%10s\n", str_ns(t_str, 32, hist.max));
+		fflush(stdout);
+	}
+	free(sent_at);
+	close_session(sock);
+	return 0;
+}
+
+/** Uploads of one size with the current send path (zc.enabled)
+  * @param speed Throughput in bytes/s
+  * @param cpu Sender cpu time per byte in ns
+  * @returns 0 on success, -1 on error */
+static int zerocopy_pass(const int sock, const long size, double *speed, double *cpu) {
+	const uint64_t cpu0 = thread_cpu_ns();
+	const uint64_t t0 = time_ns();
+	for(int i=0;i<iterations;i++)
+		if(send_test(sock, size) < 0) return -1;
+	const uint64_t wall = time_ns() - t0;
+	const double bytes = (double)size * iterations;
+	*speed = (wall > 0) ? bytes / wall * 1e9 : 0;
+	*cpu = (thread_cpu_ns() - cpu0) / bytes;
+	return 0;
+}
+
+/** Compare copying and MSG_ZEROCOPY uploads (protocol v2): Every size is uploaded with both send
+  * paths, the report shows throughput and the cpu time of the sending thread. Zerocopy pins and
+  * maps the pages and needs a completion per send instead of a copy, so it only pays off above some
+  * size; the threshold is the smallest size from which on zerocopy needs less cpu per byte */
+int run_zerocopy(const char* remote, const int port) {
+	const int sock = connect_server(remote, port);
+	if(sock < 0) exit(EXIT_FAILURE);
+	pin_thread(pin_cpu);
+	if(open_session(sock) < 0) {
+		close(sock);
+		return -1;
+	}
+	if(proto < 2) {
+		fprintf(stderr, "The zerocopy comparison needs a protocol v2 server\n");
+		close_session(sock);
+		return -1;
+	}
+	if(!zc.enabled) {
+		fprintf(stderr, "Zerocopy is not available\n");
+		close_session(sock);
+		return -1;
+	}
+	const long *bytes;
+	const int nTests = test_sizes(&bytes);
+	printf("Comparing copying and zerocopy uploads, %d sizes with %d iterations each\n\n", nTests, iterations);
+	printf("%10s\t%-24s\t%10s\t%-24s\t%10s\t%s\n", "Size", "copy", "cpu/KB", "zerocopy", "cpu/KB", "copied");
+	char strbuf[4][256];
+	long threshold = -1;
+	for(int i=0;i<nTests;i++) {
+		const long size = bytes[i];
+		double speed_copy, cpu_copy, speed_zc, cpu_zc;
+		zc.enabled = false;
+		if(zerocopy_pass(sock, size, &speed_copy, &cpu_copy) < 0) {
+			fprintf(stderr, "error: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		zc.enabled = true;
+		const uint32_t completed = zc.completed;
+		const uint64_t copied = zc.copied;
+		if(zerocopy_pass(sock, size, &speed_zc, &cpu_zc) < 0) {
+			fprintf(stderr, "error: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		// Sends the kernel copied after all (e.g. loopback or a device without scatter-gather)
+		const uint32_t sends = zc.completed - completed;
+		const double copied_pct = (sends > 0) ? 100.0 * (zc.copied - copied) / sends : 0;
+		printf("%10ld\t%-24s\t%10s\t%-24s\t%10s\t%5.1f %%\n", size, str_speed(strbuf[0], 256, speed_copy), str_ns(strbuf[1], 256, cpu_copy * 1024),
+			str_speed(strbuf[2], 256, speed_zc), str_ns(strbuf[3], 256, cpu_zc * 1024), copied_pct);
+		fflush(stdout);
+		if(cpu_zc >= cpu_copy) threshold = -1;
+		else if(threshold < 0) threshold = size;
+	}
+	if(threshold > 0)
+		printf("\nZerocopy saves sender cpu from %ld bytes on\n", threshold);
+	else
+		printf("\nZerocopy does not save sender cpu on this path\n");
+	if(zc.copied > 0)
+		printf("The kernel copied %lu of %u zerocopy sends after all (loopback always copies)\n", zc.copied, zc.completed);
+	close_session(sock);
+	return 0;
+}
+
+/** Set sockopts to the given combination of the sweep and describe it in buf */
+static char* sweep_config(char* buf, const size_t size, int config) {
+	buf[0] = '\0';
+	char opt[64];
+	for(int i=0;i<SOCKOPTS;i++) {
+		if(sweep_count[i] == 0) continue;
+		sockopts[i] = sweep_values[i][config % sweep_count[i]];
+		config /= sweep_count[i];
+		const size_t len = strlen(buf);
+		snprintf(buf + len, size - len, "%s%s", (len > 0) ? " " : "", str_sockopt(opt, sizeof(opt), i, sockopts[i]));
+	}
+	return buf;
+}
+
+/** Socket option sweep: Run the echo size table for every combination of the --sockopt values, on a
+  * new connection each, and report the best and the worst combination per size. Sizes are compared
+  * by their median message time, which is more robust against single outliers than the minimum.
+  * Combinations that fail are left out from the failing size on */
+int run_sweep(const char* remote, const int port) {
+	const long *bytes;
+	const int nTests = test_sizes(&bytes);
+	const int configs = sweep_configs();
+	double *speed = calloc((size_t)configs * nTests, sizeof(double));	// Bytes/s per config and size, 0 = failed
+	char (*labels)[256] = calloc((size_t)configs, sizeof(*labels));
+	if(speed == NULL || labels == NULL) {
+		fprintf(stderr, "Cannot allocate sweep results: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	printf("Sweeping %d socket option combinations, %d sizes with %d iterations each\n\n", configs, nTests, iterations);
+
+	static hist_t hist;
+	char strbuf[2][256];
+	pin_thread(pin_cpu);
+	signal(SIGPIPE, SIG_IGN);		// A combination that breaks the connection must not end the sweep
+	for(int c=0;c<configs;c++) {
+		sweep_config(labels[c], sizeof(labels[c]), c);
+		printf("[%d/%d] %-60s\t", c+1, configs, labels[c]);
+		fflush(stdout);
+		const int sock = connect_server(remote, port);
+		if(sock < 0) {
+			printf("skipped\n");
+			continue;
+		}
+		if(open_session(sock) < 0) {
+			close(sock);
+			buf_free(client_buf, CHUNK_SIZE*2);
+			client_buf = NULL;
+			printf("skipped\n");
+			continue;
+		}
+		double max_speed = 0;
+		long failed = 0;
+		for(int i=0;i<nTests && failed == 0;i++) {
+			const long size = bytes[i];
+			hist_reset(&hist);
+			for(int j=0;j<iterations;j++) {
+				pair_l l = bw_test(sock, size);
+				if(l.f < 0 || l.s < 0) {
+					fprintf(stderr, "error: %s\n", strerror(errno));
+					failed = size;
+					break;
+				}
+				hist_record(&hist, (l.f + l.s) / 2L);
+			}
+			if(failed > 0) break;		// This and the remaining sizes stay 0 (n/a)
+			const uint64_t p50 = hist_percentile(&hist, 50);
+			speed[c*nTests + i] = (p50 > 0) ? (double)size / p50 * 1e9 : 0;
+			if(speed[c*nTests + i] > max_speed) max_speed = speed[c*nTests + i];
+		}
+		if(failed > 0) printf("failed at %ld bytes\n", failed);
+		else printf("max %s\n", str_speed(strbuf[0], 256, max_speed));
+		close_session(sock);
+	}
+
+	printf("\n%10s\t%-24s\t%-24s\t%s\n", "Size", "best", "worst", "best combination");
+	for(int i=0;i<nTests;i++) {
+		int best = -1, worst = -1;
+		for(int c=0;c<configs;c++) {
+			const double v = speed[c*nTests + i];
+			if(v <= 0) continue;
+			if(best < 0 || v > speed[best*nTests + i]) best = c;
+			if(worst < 0 || v < speed[worst*nTests + i]) worst = c;
+		}
+		if(best < 0) {
+			printf("%10ld\t%-24s\t%-24s\t%s\n", bytes[i], "n/a", "n/a", "n/a");
+			continue;
+		}
+		printf("%10ld\t%-24s\t%-24s\t%s\n", bytes[i], str_speed(strbuf[0], 256, speed[best*nTests + i]),
+			str_speed(strbuf[1], 256, speed[worst*nTests + i]), labels[best]);
+	}
+	free(labels);
+	free(speed);
 	return 0;
 }
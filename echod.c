@@ -10,38 +10,122 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdbool.h>
 #include <string.h>
 #include <strings.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <pthread.h>
+#include <sched.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <netinet/tcp.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+#include <linux/filter.h>
+#include <linux/if_packet.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#if defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+#define HAVE_IO_URING 1
+#endif
 
 #define BUF_SIZE 10240L
+#define EPOLL_EVENTS 256			// Events per epoll_wait call
+#define CONN_OUTBUF_MAX (256L*1024L)	// Pending output per connection before we stop reading
+#define WORKERS_MAX 256				// Maximum number of epoll workers
+#define UDP_WORKERS_MAX 256			// Maximum number of udp sockets in the SO_REUSEPORT group
+#define UDP_BATCH_MAX 1024			// Maximum number of datagrams per recvmmsg/sendmmsg call
+#define SPLICE_PIPE_SIZE (1024L*1024L)	// Requested pipe size for splice
+#define STATS_SLOTS 1024			// Maximum number of threads with own counters
+#define BATCH_HIST 11				// log2 buckets of the batch fill (1, 2-3, 4-7, ..., 1024)
+
+/** I/O engine for tcp connections */
+typedef enum {
+	ENGINE_EPOLL = 0,		// Fixed set of epoll workers multiplexing all connections
+	ENGINE_THREADS,			// One blocking thread per connection (legacy)
+	ENGINE_URING,			// io_uring with multishot accept/recv and provided buffers (tcp and udp)
+} engine_t;
+
+/** How datagrams are steered to the udp workers */
+typedef enum {
+	STEER_NONE = 0,			// Kernel reuseport hash over the 4-tuple
+	STEER_CPU,				// SO_INCOMING_CPU hint on every socket
+	STEER_CBPF,				// Reuseport CBPF program selecting the socket of the receiving cpu
+} steer_t;
+
+/** Counters of one worker thread. Every slot has its own cache line(s), so workers never share
+  * a line with each other. Readers sum up all slots */
+typedef struct {
+	size_t udp_bytes;
+	size_t udp_packets;
+	size_t udp_errors;
+	size_t udp_dropped;		// Replies that could not be sent
+	size_t tcp_bytes;
+	size_t tcp_packets;		// Reads echoed
+	size_t tcp_errors;
+	size_t tcp_accepted;
+	size_t tcp_closed;
+	size_t batches;			// recvmmsg calls that returned datagrams
+	size_t batch_full;		// Calls that filled the whole batch
+	size_t batch_hist[BATCH_HIST];
+} __attribute__((aligned(64))) worker_stats_t;
+#define STATS_COUNTERS (offsetof(worker_stats_t, batch_hist)/sizeof(size_t) + BATCH_HIST)
 
 
 static int port = 7; // See https://tools.ietf.org/html/rfc862
 static int sock_udp = 0;
 static int sock_tcp = 0;
-static pthread_t tid_udp = 0;
+static int udp_socks[UDP_WORKERS_MAX];
+static pthread_t udp_tids[UDP_WORKERS_MAX];
+static int udp_socks_count = 0;
 static pthread_t tid_tcp = 0;
-static volatile size_t bytes_udp = 0;
-static volatile size_t bytes_tcp = 0;
+static pthread_t tid_packet = 0;
+static char *packet_iface = NULL;		// Reflect udp via a PACKET_MMAP ring on this interface
 static volatile bool running = true;
+static worker_stats_t stats[STATS_SLOTS];	// Slot 0 is shared by the threads engine connections
+static int stats_count = 1;
+static int sig_pipe[2] = {-1, -1};		// SIGUSR1 -> monitor thread
+static int sock_metrics = 0;
+static engine_t engine = ENGINE_EPOLL;
+static int n_workers = 0;				// Number of epoll workers (0 = one per core)
+static int n_udp_workers = 1;			// Number of udp sockets/threads
+static steer_t steer = STEER_NONE;
+static int udp_batch = 1;				// Datagrams per recvmmsg/sendmmsg (1 = recvfrom/sendto)
+static bool uring_sqpoll = false;		// Use a kernel submission thread for io_uring
+static bool use_splice = false;			// Zero-copy tcp echo with splice
+static bool busy_poll = false;			// Spin on non-blocking receives instead of sleeping
 
 
-/** Create udp server on the given port
+/** Create udp server on the given port. With more than one worker, every worker
+  * owns its own SO_REUSEPORT socket and is pinned to a cpu
   * @param port Port to listen on
+  * @param n number of workers
+  * @returns 0 on success, negative value on error and setting errno accordingly */
+int udp_server(const int port, const int n);
+
+/** Create the PACKET_MMAP (TPACKET_V3) udp reflector on the given interface. It receives the
+  * datagrams for the given port from a mmap'ed RX ring and transmits the replies via the TX ring
+  * @param iface Interface name
+  * @param port udp port to reflect
   * @param pid thread id
-  * @param sock socket that is created
   * @returns 0 on success, negative value on error and setting errno accordingly */
-int udp_server(const int port, pthread_t *pid, int *sock);
+int packet_ring_server(const char *iface, const int port, pthread_t *pid);
 
 /** Create tcp server on the given port
   * @param port Port to listen on
@@ -50,6 +134,22 @@ int udp_server(const int port, pthread_t *pid, int *sock);
   * @returns 0 on success, negative value on error and setting errno accordingly */
 int tcp_server(const int port, pthread_t *pid, int *sock);
 
+/** Start the epoll workers for the tcp server
+  * @param n number of worker threads
+  * @returns 0 on success, negative value on error and setting errno accordingly */
+int epoll_engine_start(int n);
+
+/** Wait for all epoll workers to terminate */
+void epoll_engine_join();
+
+/** Print the aggregated counters */
+void print_stats(FILE *out);
+
+/** Start the monitor thread, that prints the counters on SIGUSR1 and serves the metrics socket
+  * @param metrics_port Port for the metrics on the loopback interface or 0 to disable
+  * @returns 0 on success, negative value on error and setting errno accordingly */
+int monitor_start(const int metrics_port);
+
 void sig_handler(int signo);
 
 void cleanup();
@@ -61,6 +161,7 @@ int main(int argc, char** argv) {
     uid_t uid = 0;
     gid_t gid = 0;
     char *w_dir = NULL;
+    int metrics_port = 0;
     
     for(int i=1;i<argc;i++) {
     	const char* arg = argv[i];
@@ -76,6 +177,20 @@ int main(int argc, char** argv) {
     			printf("  -t, --tcp             Enable tcp server\n");
     			printf("      --noudp           Disable udp server\n");
     			printf("      --notcp           Disable tcp server\n");
+    			printf("      --engine ENGINE   I/O engine: 'epoll' (default) or 'threads' for tcp,\n");
+    			printf("                        'uring' for tcp and udp\n");
+    			printf("      --sqpoll          Use a kernel submission thread (SQPOLL) with io_uring\n");
+    			printf("      --splice          Zero-copy tcp echo via splice (epoll and threads engine)\n");
+    			printf("      --workers N       Number of epoll workers (default: one per core)\n");
+    			printf("      --udp-workers N   Number of udp workers with SO_REUSEPORT sockets (default: 1)\n");
+    			printf("      --steer MODE      udp steering: 'none' (default), 'cpu' (SO_INCOMING_CPU)\n");
+    			printf("                        or 'cbpf' (reuseport bpf, answer on the receiving cpu)\n");
+    			printf("      --batch N         Echo up to N datagrams per recvmmsg/sendmmsg (default: 1)\n");
+    			printf("      --packet-ring IF  Reflect udp from a PACKET_MMAP ring on interface IF instead\n");
+    			printf("                        of a udp socket (requires CAP_NET_RAW)\n");
+    			printf("      --busy-poll       Spin on non-blocking receives (and SO_BUSY_POLL) instead\n");
+    			printf("                        of sleeping, udp workers are always pinned\n");
+    			printf("      --metrics PORT    Serve counters (Prometheus text format) on 127.0.0.1:PORT\n");
     			printf("  -d, --daemon          Run as daemon\n");
     			printf("      --user UID        Run as user UID\n");
     			printf("      --group GID       Run as group GID\n");
@@ -91,6 +206,63 @@ int main(int argc, char** argv) {
     			udp = false;
     		} else if(!strcmp("--notcp", arg)) {
     			tcp = false;
+    		} else if(!strcmp("--engine", arg) && i < argc-1) {
+    			const char *name = argv[++i];
+    			if(!strcmp("epoll", name))
+    				engine = ENGINE_EPOLL;
+    			else if(!strcmp("threads", name))
+    				engine = ENGINE_THREADS;
+    			else if(!strcmp("uring", name)) {
+#ifdef HAVE_IO_URING
+    				engine = ENGINE_URING;
+#else
+    				fprintf(stderr, "echod was compiled without io_uring support\n");
+    				exit(EXIT_FAILURE);
+#endif
+    			}    			else {
+    				fprintf(stderr, "Unknown engine: %s\n", name);
+    				exit(EXIT_FAILURE);
+    			}
+    		} else if(!strcmp("--packet-ring", arg) && i < argc-1) {
+    			packet_iface = argv[++i];
+    		} else if(!strcmp("--metrics", arg) && i < argc-1) {
+    			metrics_port = atoi(argv[++i]);
+    		} else if(!strcmp("--busy-poll", arg)) {
+    			busy_poll = true;
+    		} else if(!strcmp("--splice", arg)) {
+    			use_splice = true;
+    		} else if(!strcmp("--sqpoll", arg)) {
+    			uring_sqpoll = true;
+    		} else if(!strcmp("--workers", arg) && i < argc-1) {
+    			n_workers = atoi(argv[++i]);
+    			if(n_workers < 1 || n_workers > WORKERS_MAX) {
+    				fprintf(stderr, "workers must be between 1 and %d\n", WORKERS_MAX);
+    				exit(EXIT_FAILURE);
+    			}
+    		} else if(!strcmp("--udp-workers", arg) && i < argc-1) {
+    			n_udp_workers = atoi(argv[++i]);
+    			if(n_udp_workers < 1 || n_udp_workers > UDP_WORKERS_MAX) {
+    				fprintf(stderr, "udp workers must be between 1 and %d\n", UDP_WORKERS_MAX);
+    				exit(EXIT_FAILURE);
+    			}
+    		} else if(!strcmp("--steer", arg) && i < argc-1) {
+    			const char *name = argv[++i];
+    			if(!strcmp("none", name))
+    				steer = STEER_NONE;
+    			else if(!strcmp("cpu", name))
+    				steer = STEER_CPU;
+    			else if(!strcmp("cbpf", name))
+    				steer = STEER_CBPF;
+    			else {
+    				fprintf(stderr, "Unknown steering mode: %s\n", name);
+    				exit(EXIT_FAILURE);
+    			}
+    		} else if(!strcmp("--batch", arg) && i < argc-1) {
+    			udp_batch = atoi(argv[++i]);
+    			if(udp_batch < 1 || udp_batch > UDP_BATCH_MAX) {
+    				fprintf(stderr, "batch size must be between 1 and %d\n", UDP_BATCH_MAX);
+    				exit(EXIT_FAILURE);
+    			}
     		} else if(!strcmp("--user", arg)) {
     			uid = (uid_t)atoi(argv[++i]);
     		} else if(!strcmp("--group", arg)) {
@@ -99,7 +271,7 @@ int main(int argc, char** argv) {
     			w_dir = argv[++i];
     		}
     	} else
-    		port = atoi(argv[1]);
+    		port = atoi(arg);
     }
 
     if (daemon) { // Fork daemon
@@ -122,14 +294,33 @@ int main(int argc, char** argv) {
     signal(SIGUSR1, sig_handler);
     atexit(cleanup);
 
-    if(udp) {
-    	int rc = udp_server(port, &tid_udp, &sock_udp);
+    if(monitor_start(metrics_port) != 0) {
+    	fprintf(stderr, "Error starting monitor: %s\n", strerror(errno));
+    	exit(EXIT_FAILURE);
+    }
+
+    if(udp && packet_iface != NULL) {
+    	if(packet_ring_server(packet_iface, port, &tid_packet) != 0) {
+    		fprintf(stderr, "Error creating packet ring on %s: %s\n", packet_iface, strerror(errno));
+    		exit(EXIT_FAILURE);
+    	}
+    } else if(udp) {
+    	int rc = udp_server(port, n_udp_workers);
     	if(rc != 0) {
     		fprintf(stderr, "Error creating udp server: %s\n", strerror(errno));
     		exit(EXIT_FAILURE);
     	}
     }
     if(tcp) {
+    	if(engine == ENGINE_EPOLL) {
+    		if(n_workers <= 0) n_workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    		if(n_workers <= 0) n_workers = 1;
+    		if(n_workers > WORKERS_MAX) n_workers = WORKERS_MAX;
+    		if(epoll_engine_start(n_workers) != 0) {
+    			fprintf(stderr, "Error starting epoll workers: %s\n", strerror(errno));
+    			exit(EXIT_FAILURE);
+    		}
+    	}
     	int rc = tcp_server(port, &tid_tcp, &sock_tcp);
     	if(rc != 0) {
     		fprintf(stderr, "Error creating tcp server: %s\n", strerror(errno));
@@ -162,26 +353,464 @@ int main(int argc, char** argv) {
     }
     
     // Wait for threads to terminate
-    if(tid_udp > 0) {
-    	pthread_join(tid_udp, NULL);
+    for(int i=0;i<udp_socks_count;i++) {
+    	pthread_join(udp_tids[i], NULL);
     }
     if(tid_tcp > 0) {
     	pthread_join(tid_tcp, NULL);
     }
+    if(tid_packet > 0) {
+    	pthread_join(tid_packet, NULL);
+    }
+    epoll_engine_join();
 
-	if (sock_udp > 0)
-		printf("udp server handled %ld bytes\n", bytes_udp);
-	if (sock_tcp > 0)
-		printf("tcp server handled %ld bytes\n", bytes_tcp);
+	print_stats(stdout);
 
     return EXIT_SUCCESS;
 }
 
+/* ==== counters and metrics ================================================ */
+
+/** Slot of the calling thread. Every thread that echos owns a slot and is its only writer */
+static worker_stats_t * stats_slot() {
+	const int i = __atomic_fetch_add(&stats_count, 1, __ATOMIC_RELAXED);
+	if(i >= STATS_SLOTS) {
+		fprintf(stderr, "Too many workers for the statistics\n");
+		exit(EXIT_FAILURE);
+	}
+	return &stats[i];
+}
+
+/** Add to a counter of the own slot. There is a single writer, so no locked instruction is needed */
+static inline void stat_add(size_t *counter, const size_t value) {
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+/** Sum up the counters of all slots */
+static void stats_sum(worker_stats_t *sum) {
+	bzero(sum, sizeof(worker_stats_t));
+	const int n = __atomic_load_n(&stats_count, __ATOMIC_RELAXED);
+	for(int i=0;i<n && i<STATS_SLOTS;i++) {
+		const size_t *src = (const size_t*)&stats[i];
+		size_t *dst = (size_t*)sum;
+		for(size_t j=0;j<STATS_COUNTERS;j++)
+			dst[j] += __atomic_load_n(&src[j], __ATOMIC_RELAXED);
+	}
+}
+
+/** Resident memory of this process in bytes */
+static size_t resident_bytes() {
+	FILE *f = fopen("/proc/self/statm", "r");
+	if(f == NULL) return 0;
+	unsigned long size = 0, resident = 0;
+	if(fscanf(f, "%lu %lu", &size, &resident) != 2) resident = 0;
+	fclose(f);
+	return resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+void print_stats(FILE *out) {
+	worker_stats_t sum;
+	stats_sum(&sum);
+	if (sock_udp > 0 || packet_iface != NULL) {
+		fprintf(out, "udp:%d - %ld bytes, %ld datagrams, %ld errors\n", port, sum.udp_bytes, sum.udp_packets, sum.udp_errors);
+		if(sum.batches > 0) {
+			fprintf(out, "udp batches: %ld calls, %ld datagrams, avg fill %.2f/%d, %.1f%% full, %ld dropped\n", sum.batches, sum.udp_packets,
+				(double)sum.udp_packets/(double)sum.batches, udp_batch, 100.0*(double)sum.batch_full/(double)sum.batches, sum.udp_dropped);
+			fprintf(out, "udp batch fill:");
+			for(int j=0;j<BATCH_HIST;j++) {
+				if(sum.batch_hist[j] == 0) continue;
+				fprintf(out, " [%d-%d]=%ld", 1<<j, (2<<j)-1, sum.batch_hist[j]);
+			}
+			fprintf(out, "\n");
+		}
+	}
+	if (sock_tcp > 0)
+		fprintf(out, "tcp:%d - %ld bytes, %ld reads, %ld connections (%ld active), %ld errors\n", port, sum.tcp_bytes, sum.tcp_packets,
+			sum.tcp_accepted, sum.tcp_accepted - sum.tcp_closed, sum.tcp_errors);
+	fflush(out);
+}
+
+/** Write the aggregated counters in the Prometheus text format */
+static void print_metrics(FILE *out) {
+	worker_stats_t sum;
+	stats_sum(&sum);
+	fprintf(out, "# HELP echod_bytes_total Bytes echoed\n# TYPE echod_bytes_total counter\n");
+	fprintf(out, "echod_bytes_total{proto=\"udp\"} %ld\n", sum.udp_bytes);
+	fprintf(out, "echod_bytes_total{proto=\"tcp\"} %ld\n", sum.tcp_bytes);
+	fprintf(out, "# HELP echod_packets_total Datagrams (udp) or reads (tcp) echoed\n# TYPE echod_packets_total counter\n");
+	fprintf(out, "echod_packets_total{proto=\"udp\"} %ld\n", sum.udp_packets);
+	fprintf(out, "echod_packets_total{proto=\"tcp\"} %ld\n", sum.tcp_packets);
+	fprintf(out, "# HELP echod_errors_total Receive and send errors\n# TYPE echod_errors_total counter\n");
+	fprintf(out, "echod_errors_total{proto=\"udp\"} %ld\n", sum.udp_errors);
+	fprintf(out, "echod_errors_total{proto=\"tcp\"} %ld\n", sum.tcp_errors);
+	fprintf(out, "# HELP echod_connections_total Accepted tcp connections\n# TYPE echod_connections_total counter\n");
+	fprintf(out, "echod_connections_total %ld\n", sum.tcp_accepted);
+	fprintf(out, "# HELP echod_connections_active Open tcp connections\n# TYPE echod_connections_active gauge\n");
+	fprintf(out, "echod_connections_active %ld\n", sum.tcp_accepted - sum.tcp_closed);
+	fprintf(out, "# HELP echod_udp_dropped_total Udp replies that could not be sent\n# TYPE echod_udp_dropped_total counter\n");
+	fprintf(out, "echod_udp_dropped_total %ld\n", sum.udp_dropped);
+	fprintf(out, "# HELP echod_udp_batch_fill Datagrams per recvmmsg call\n# TYPE echod_udp_batch_fill histogram\n");
+	size_t cumulative = 0;
+	for(int j=0;j<BATCH_HIST;j++) {
+		cumulative += sum.batch_hist[j];
+		fprintf(out, "echod_udp_batch_fill_bucket{le=\"%d\"} %ld\n", (2<<j)-1, cumulative);
+	}
+	fprintf(out, "echod_udp_batch_fill_bucket{le=\"+Inf\"} %ld\n", cumulative);
+	fprintf(out, "echod_udp_batch_fill_sum %ld\n", sum.batches > 0 ? sum.udp_packets : 0L);
+	fprintf(out, "echod_udp_batch_fill_count %ld\n", sum.batches);
+	fprintf(out, "# HELP echod_resident_bytes Resident memory\n# TYPE echod_resident_bytes gauge\n");
+	fprintf(out, "echod_resident_bytes %ld\n", resident_bytes());
+}
+
+/** Answer a metrics query with a minimal HTTP response, so that curl and Prometheus can scrape us */
+static void metrics_reply(const int fd) {
+	// Read the request, if any. Plain connections (e.g. netcat) get the metrics after a short timeout
+	struct timeval tv;
+	tv.tv_sec = 0;
+	tv.tv_usec = 100000;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	char req[1024];
+	ssize_t len = recv(fd, req, sizeof(req)-1, 0);
+	const bool http = (len >= 4 && !strncmp(req, "GET ", 4));
+
+	char *body = NULL;
+	size_t body_len = 0;
+	FILE *out = open_memstream(&body, &body_len);
+	if(out == NULL) return;
+	print_metrics(out);
+	fclose(out);
+
+	FILE *f = fdopen(dup(fd), "w");
+	if(f != NULL) {
+		if(http)
+			fprintf(f, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %ld\r\nConnection: close\r\n\r\n", body_len);
+		fwrite(body, 1, body_len, f);
+		fclose(f);
+	}
+	free(body);
+}
+
+/** Monitor thread: Prints the counters on SIGUSR1 (outside of the signal handler) and serves the metrics socket */
+static void * monitor_thread(void * args) {
+	(void)args;
+	while(running) {
+		struct pollfd fds[2];
+		int nfds = 0;
+		fds[nfds].fd = sig_pipe[0];
+		fds[nfds++].events = POLLIN;
+		if(sock_metrics > 0) {
+			fds[nfds].fd = sock_metrics;
+			fds[nfds++].events = POLLIN;
+		}
+		int rc = poll(fds, (nfds_t)nfds, 1000);
+		if(rc < 0) {
+			if(errno == EINTR) continue;
+			break;
+		}
+		if(fds[0].revents & POLLIN) {
+			char c;
+			if(read(sig_pipe[0], &c, 1) == 1) print_stats(stdout);
+		}
+		if(nfds > 1 && (fds[1].revents & POLLIN)) {
+			const int fd = accept4(sock_metrics, NULL, NULL, SOCK_CLOEXEC);
+			if(fd >= 0) {
+				metrics_reply(fd);
+				close(fd);
+			}
+		}
+	}
+	return NULL;
+}
+
+int monitor_start(const int metrics_port) {
+	if(pipe2(sig_pipe, O_CLOEXEC | O_NONBLOCK) < 0) return -1;
+	if(metrics_port > 0) {
+		int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if(fd < 0) return -1;
+		int one = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		struct sockaddr_in addr;
+		bzero(&addr, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);	// Local queries only
+		addr.sin_port = htons(metrics_port);
+		if(bind(fd, (const struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+			close(fd);
+			return -1;
+		}
+		sock_metrics = fd;
+	}
+	pthread_t tid;
+	int rc = pthread_create(&tid, NULL, monitor_thread, NULL);
+	if(rc != 0) {
+		errno = rc;
+		return -1;
+	}
+	pthread_detach(tid);
+	return 0;
+}
+
+/* ==== PACKET_MMAP reflector =============================================== */
+
+#define RING_BLOCK_SIZE (1L << 20)	// Size of a ring block
+#define RING_BLOCKS 16				// Blocks per ring
+#define RING_FRAME_SIZE 2048L		// Frame size of the TX ring (and RX ring granularity)
+
+/** AF_PACKET socket with mmap'ed TPACKET_V3 RX and TX rings */
+typedef struct {
+	int fd;
+	char *map;
+	size_t map_size;
+	char *rx;				// RX ring: RING_BLOCKS blocks
+	char *tx;				// TX ring: Fixed size frames
+	unsigned int tx_frames;
+	unsigned int tx_next;
+	unsigned int tx_pending;	// Frames queued since the last kick
+} pring_t;
+
+/** Attach a classic bpf filter that only passes incoming, unfragmented IPv4 udp datagrams for the given port */
+static int pring_filter(const int fd, const int port) {
+	struct sock_filter code[] = {
+		{ BPF_LD  | BPF_B | BPF_ABS, 0, 0, (uint32_t)(SKF_AD_OFF + SKF_AD_PKTTYPE) },
+		{ BPF_JMP | BPF_JEQ | BPF_K, 9, 0, PACKET_OUTGOING },	// Loopback: Skip the outgoing copy
+		{ BPF_LD  | BPF_H | BPF_ABS, 0, 0, 12 },				// Ethertype
+		{ BPF_JMP | BPF_JEQ | BPF_K, 0, 7, ETH_P_IP },
+		{ BPF_LD  | BPF_B | BPF_ABS, 0, 0, 23 },				// IP protocol
+		{ BPF_JMP | BPF_JEQ | BPF_K, 0, 5, IPPROTO_UDP },
+		{ BPF_LD  | BPF_H | BPF_ABS, 0, 0, 20 },				// Flags and fragment offset
+		{ BPF_JMP | BPF_JSET | BPF_K, 3, 0, 0x3fff },			// Any fragment, including the first (MF)
+		{ BPF_LDX | BPF_B | BPF_MSH, 0, 0, 14 },				// X = IP header length
+		{ BPF_LD  | BPF_H | BPF_IND, 0, 0, 16 },				// udp destination port
+		{ BPF_JMP | BPF_JEQ | BPF_K, 1, 0, (uint32_t)port },
+		{ BPF_RET | BPF_K, 0, 0, 0 },							// Drop
+		{ BPF_RET | BPF_K, 0, 0, 0xffff },						// Accept
+	};
+	struct sock_fprog prog;
+	prog.len = sizeof(code)/sizeof(code[0]);
+	prog.filter = code;
+	return setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
+static void pring_free(pring_t *r) {
+	if(r->map != NULL) munmap(r->map, r->map_size);
+	if(r->fd > 0) close(r->fd);
+}
+
+static int pring_setup(pring_t *r, const char *iface, const int port) {
+	const unsigned int ifindex = if_nametoindex(iface);
+	if(ifindex == 0) return -1;
+
+	r->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+	if(r->fd < 0) return -1;
+	// Filter before binding, so that no unrelated packets end up in the ring
+	if(pring_filter(r->fd, port) < 0) return -1;
+
+	int version = TPACKET_V3;
+	if(setsockopt(r->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) return -1;
+	int one = 1;
+	if(setsockopt(r->fd, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one)) < 0)
+		fprintf(stderr, "Warning: Failed to set PACKET_QDISC_BYPASS: %s\n", strerror(errno));
+
+	struct tpacket_req3 req;
+	bzero(&req, sizeof(req));
+	req.tp_block_size = RING_BLOCK_SIZE;
+	req.tp_block_nr = RING_BLOCKS;
+	req.tp_frame_size = RING_FRAME_SIZE;
+	req.tp_frame_nr = (RING_BLOCK_SIZE / RING_FRAME_SIZE) * RING_BLOCKS;
+	req.tp_retire_blk_tov = 1;		// Hand out partially filled blocks after 1 ms
+	if(setsockopt(r->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) return -1;
+	req.tp_retire_blk_tov = 0;
+	if(setsockopt(r->fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0) return -1;
+	r->tx_frames = req.tp_frame_nr;
+
+	r->map_size = 2 * RING_BLOCK_SIZE * RING_BLOCKS;
+	r->map = (char*)mmap(NULL, r->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED | MAP_POPULATE, r->fd, 0);
+	if(r->map == MAP_FAILED) {
+		r->map = (char*)mmap(NULL, r->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, 0);
+		if(r->map == MAP_FAILED) {
+			r->map = NULL;
+			return -1;
+		}
+	}
+	r->rx = r->map;
+	r->tx = r->map + RING_BLOCK_SIZE * RING_BLOCKS;
+
+	struct sockaddr_ll addr;
+	bzero(&addr, sizeof(addr));
+	addr.sll_family = AF_PACKET;
+	addr.sll_protocol = htons(ETH_P_ALL);
+	addr.sll_ifindex = (int)ifindex;
+	return bind(r->fd, (const struct sockaddr*)&addr, sizeof(addr));
+}
+
+/** Put the reply to the given frame into the TX ring. Swapping addresses and ports keeps both checksums valid.
+  * Frames with a checksum that is not computed yet (offloading, loopback) are sent without udp checksum */
+static bool pring_reflect(pring_t *r, const char *frame, const size_t len, const bool csum_partial) {
+	const size_t data_off = TPACKET_ALIGN(sizeof(struct tpacket3_hdr));
+	if(len < ETH_HLEN + sizeof(struct iphdr) + sizeof(struct udphdr) || len > RING_FRAME_SIZE - data_off) return false;
+
+	struct tpacket3_hdr *hdr = (struct tpacket3_hdr*)(r->tx + (size_t)r->tx_next * RING_FRAME_SIZE);
+	if(__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) != TP_STATUS_AVAILABLE) return false;	// TX ring full
+
+	char *out = (char*)hdr + data_off;
+	memcpy(out, frame, len);
+	struct ethhdr *eth = (struct ethhdr*)out;
+	unsigned char mac[ETH_ALEN];
+	memcpy(mac, eth->h_dest, ETH_ALEN);
+	memcpy(eth->h_dest, eth->h_source, ETH_ALEN);
+	memcpy(eth->h_source, mac, ETH_ALEN);
+	struct iphdr *ip = (struct iphdr*)(out + ETH_HLEN);
+	const size_t ihl = (size_t)ip->ihl * 4;
+	if(ihl < sizeof(struct iphdr) || ETH_HLEN + ihl + sizeof(struct udphdr) > len) return false;
+	const uint32_t saddr = ip->saddr;
+	ip->saddr = ip->daddr;
+	ip->daddr = saddr;
+	struct udphdr *udp = (struct udphdr*)(out + ETH_HLEN + ihl);
+	const uint16_t sport = udp->source;
+	udp->source = udp->dest;
+	udp->dest = sport;
+	if(csum_partial) udp->check = 0;
+
+	hdr->tp_len = (uint32_t)len;
+	hdr->tp_snaplen = (uint32_t)len;
+	hdr->tp_next_offset = 0;
+	__atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+	r->tx_next = (r->tx_next + 1) % r->tx_frames;
+	r->tx_pending++;
+	return true;
+}
+
+/** Tell the kernel to transmit the queued frames. One syscall per RX block, not per packet */
+static void pring_kick(pring_t *r) {
+	if(r->tx_pending == 0) return;
+	if(send(r->fd, NULL, 0, MSG_DONTWAIT) < 0 && errno != EAGAIN && errno != ENOBUFS)
+		fprintf(stderr, "packet ring send error: %s\n", strerror(errno));
+	r->tx_pending = 0;
+}
+
+static void * pring_thread(void * args) {
+	pring_t *r = (pring_t*)args;
+	worker_stats_t *st = stats_slot();
+	unsigned int block = 0;
+
+	while(running) {
+		struct tpacket_block_desc *bd = (struct tpacket_block_desc*)(r->rx + (size_t)block * RING_BLOCK_SIZE);
+		if(!(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+			if(busy_poll) {
+				sched_yield();
+				continue;
+			}
+			struct pollfd pfd;
+			pfd.fd = r->fd;
+			pfd.events = POLLIN | POLLERR;
+			pfd.revents = 0;
+			poll(&pfd, 1, 1000);
+			continue;
+		}
+
+		const uint32_t n = bd->hdr.bh1.num_pkts;
+		struct tpacket3_hdr *ppd = (struct tpacket3_hdr*)((char*)bd + bd->hdr.bh1.offset_to_first_pkt);
+		for(uint32_t i=0;i<n;i++) {
+			const char *frame = (const char*)ppd + ppd->tp_mac;
+			if(ppd->tp_snaplen == ppd->tp_len && pring_reflect(r, frame, ppd->tp_snaplen, (ppd->tp_status & TP_STATUS_CSUMNOTREADY) != 0)) {
+				stat_add(&st->udp_packets, 1);
+				const struct iphdr *ip = (const struct iphdr*)(frame + ETH_HLEN);
+				stat_add(&st->udp_bytes, ppd->tp_len - ETH_HLEN - ip->ihl*4 - sizeof(struct udphdr));
+			} else {
+				stat_add(&st->udp_dropped, 1);
+			}
+			ppd = (struct tpacket3_hdr*)((char*)ppd + ppd->tp_next_offset);
+		}
+		pring_kick(r);
+		__atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+		block = (block + 1) % RING_BLOCKS;
+	}
+
+	pring_free(r);
+	free(r);
+	return NULL;
+}
+
+int packet_ring_server(const char *iface, const int port, pthread_t *pid) {
+	pring_t *r = (pring_t*)calloc(1, sizeof(pring_t));
+	if(r == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	if(pring_setup(r, iface, port) < 0) goto fail;
+	int rc = pthread_create(pid, NULL, pring_thread, r);
+	if(rc != 0) {
+		errno = rc;
+		goto fail;
+	}
+	return 0;
+fail:
+	pring_free(r);
+	free(r);
+	return -1;
+}
+
 typedef struct {
 	int sock;
 	bool udp;
+	int cpu;		// cpu to pin the thread to, or -1
 } s_thread_params_t;
 
+/** Pin the calling thread to the given cpu (best-effort) */
+static void pin_thread(int cpu) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+		fprintf(stderr, "Warning: Cannot pin thread to cpu %d\n", cpu);
+}
+
+/** Echo the connection with splice (socket -> pipe -> socket), the payload never enters user space
+  * @returns 0 when the connection is done, 1 if splice is not supported for this socket */
+static int tcp_splice_echo(const int fd) {
+	int p[2];
+	if(pipe2(p, O_CLOEXEC) < 0) return 1;
+	fcntl(p[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);	// Best-effort, limited by fs.pipe-max-size
+	int ret = 0;
+	bool first = true;
+	while(running) {
+		ssize_t len = splice(fd, NULL, p[1], NULL, SPLICE_PIPE_SIZE, SPLICE_F_MOVE);
+		if(len < 0) {
+			if(errno == EINTR) continue;
+			if(first && errno == EINVAL) ret = 1;
+			break;
+		} else if(len == 0) break;
+		first = false;
+
+		// Drain the pipe back into the socket
+		size_t left = (size_t)len;
+		while(left > 0) {
+			ssize_t slen = splice(p[0], NULL, fd, NULL, left, SPLICE_F_MOVE);
+			if(slen < 0 && errno == EINTR) continue;
+			if(slen <= 0) goto finish;
+			left -= (size_t)slen;
+		}
+		__atomic_fetch_add(&stats[0].tcp_bytes, (size_t)len, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&stats[0].tcp_packets, 1, __ATOMIC_RELAXED);
+	}
+finish:
+	close(p[0]);
+	close(p[1]);
+	return ret;
+}
+
+/** Enable busy polling in the kernel for the given socket (best-effort, may require CAP_NET_ADMIN) */
+static void setup_busy_poll(const int sock) {
+	int usecs = 50;
+	if(setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) < 0)
+		fprintf(stderr, "Warning: Failed to set SO_BUSY_POLL: %s\n", strerror(errno));
+#ifdef SO_PREFER_BUSY_POLL
+	int one = 1;
+	if(setsockopt(sock, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof(one)) < 0)
+		fprintf(stderr, "Warning: Failed to set SO_PREFER_BUSY_POLL: %s\n", strerror(errno));
+#endif
+}
+
 void * tcp_client(void * args) {
 	// Make parameters thread-local and free memory
 	s_thread_params_t *params = (s_thread_params_t*)args;
@@ -193,47 +822,862 @@ void * tcp_client(void * args) {
 	if(setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&one, sizeof(int)) < 0)
 		fprintf(stderr, "Warning: Failed to set TCP_NODELAY for new socket: %s\n", strerror(errno));
 
+	if(busy_poll) setup_busy_poll(fd);
+	if(use_splice && tcp_splice_echo(fd) == 0) goto finish;
+
 	char buf[BUF_SIZE];
 	int flags = 0; //MSG_DONTWAIT;
+	const int rflags = busy_poll ? MSG_DONTWAIT : 0;
 	while(running) {
-		ssize_t len = recv(fd, buf, BUF_SIZE, 0);
+		ssize_t len = recv(fd, buf, BUF_SIZE, rflags);
+		if(len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) { sched_yield(); continue; }
+		if(len < 0) __atomic_fetch_add(&stats[0].tcp_errors, 1, __ATOMIC_RELAXED);
 		if(len <= 0) goto finish;
 		ssize_t slen = send(fd, buf, len, flags);
-		if(slen < 0) goto finish;
-		bytes_tcp += len;		// XXX atomic add
+		if(slen < 0) {
+			__atomic_fetch_add(&stats[0].tcp_errors, 1, __ATOMIC_RELAXED);
+			goto finish;
+		}
+		__atomic_fetch_add(&stats[0].tcp_bytes, (size_t)len, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&stats[0].tcp_packets, 1, __ATOMIC_RELAXED);
 	}
 
 finish:
+	__atomic_fetch_add(&stats[0].tcp_closed, 1, __ATOMIC_RELAXED);
 	close(fd);
 	return NULL;
 }
 
+/* ==== epoll engine ======================================================== */
+
+/** Per-connection state of the epoll engine. Output is only buffered (and
+  * the buffer only allocated) when the kernel did not accept all of it. */
+typedef struct {
+	int fd;
+	char *out;				// Pending output or NULL
+	size_t out_off;			// Offset of the first pending byte
+	size_t out_len;			// Number of pending bytes
+	size_t out_cap;			// Allocated size of out
+	bool rd_blocked;		// Stopped reading because the output buffer is full
+	bool eof;				// Peer closed, close after flushing pending output
+	bool copy;				// Use the copy path, splice is disabled or not supported
+	int pipe[2];			// splice: Pipe, created on the first read (-1 if none)
+	size_t piped;			// splice: Bytes in the pipe
+} conn_t;
+
+typedef struct {
+	int epfd;
+	int cpu;
+	pthread_t tid;
+	worker_stats_t *stats;
+	char buf[BUF_SIZE];		// Receive buffer shared by all connections of this worker
+} epoll_worker_t;
+
+static epoll_worker_t *workers = NULL;
+static int workers_count = 0;
+
+static void conn_close(epoll_worker_t *w, conn_t *c) {
+	stat_add(&w->stats->tcp_closed, 1);
+	if(c->pipe[0] >= 0) close(c->pipe[0]);
+	if(c->pipe[1] >= 0) close(c->pipe[1]);
+	close(c->fd);
+	free(c->out);
+	free(c);
+}
+
+/** Send pending output. Returns 0 on success (possibly with data still pending), -1 on error */
+static int conn_flush(conn_t *c) {
+	while(c->out_len > 0) {
+		ssize_t len = send(c->fd, c->out + c->out_off, c->out_len, MSG_NOSIGNAL);
+		if(len < 0) {
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			return -1;
+		}
+		c->out_off += (size_t)len;
+		c->out_len -= (size_t)len;
+	}
+	// Release the buffer, so that idle connections stay small
+	free(c->out);
+	c->out = NULL;
+	c->out_off = 0;
+	c->out_cap = 0;
+	return 0;
+}
+
+/** Send the given data or append it to the output buffer if the socket is full */
+static int conn_write(conn_t *c, const char *data, size_t len) {
+	if(c->out_len == 0) {
+		ssize_t slen = send(c->fd, data, len, MSG_NOSIGNAL);
+		if(slen < 0) {
+			if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return -1;
+			slen = 0;
+		}
+		data += slen;
+		len -= (size_t)slen;
+		if(len == 0) return 0;
+	}
+
+	if(c->out_off + c->out_len + len > c->out_cap) {
+		if(c->out_off > 0) {
+			memmove(c->out, c->out + c->out_off, c->out_len);
+			c->out_off = 0;
+		}
+		if(c->out_len + len > c->out_cap) {
+			size_t cap = c->out_cap * 2;
+			if(cap < BUF_SIZE) cap = BUF_SIZE;
+			if(cap < c->out_len + len) cap = c->out_len + len;
+			char *out = realloc(c->out, cap);
+			if(out == NULL) return -1;
+			c->out = out;
+			c->out_cap = cap;
+		}
+	}
+	memcpy(c->out + c->out_off + c->out_len, data, len);
+	c->out_len += len;
+	return 0;
+}
+
+/** Echo everything that is readable (edge-triggered: until EAGAIN) */
+static int conn_read(epoll_worker_t *w, conn_t *c) {
+	c->rd_blocked = false;
+	while(!c->eof) {
+		if(c->out_len >= (size_t)CONN_OUTBUF_MAX) {
+			// Backpressure: resume once the peer has drained the output buffer
+			c->rd_blocked = true;
+			return 0;
+		}
+		ssize_t len = recv(c->fd, w->buf, BUF_SIZE, 0);
+		if(len < 0) {
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			stat_add(&w->stats->tcp_errors, 1);
+			return -1;
+		} else if(len == 0) {
+			c->eof = true;
+			break;
+		}
+		if(conn_write(c, w->buf, (size_t)len) < 0) {
+			stat_add(&w->stats->tcp_errors, 1);
+			return -1;
+		}
+		stat_add(&w->stats->tcp_bytes, (size_t)len);
+		stat_add(&w->stats->tcp_packets, 1);
+	}
+	return (c->out_len > 0) ? 0 : -1;	// EOF: Close once everything is sent
+}
+
+/** Echo via the connection's pipe. The pipe also serves as output buffer.
+  * Falls back to the copy path, if splice is not supported */
+static int conn_splice(epoll_worker_t *w, conn_t *c) {
+	if(c->pipe[0] < 0) {
+		if(pipe2(c->pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+			c->pipe[0] = c->pipe[1] = -1;
+			c->copy = true;
+			return conn_read(w, c);
+		}
+	}
+	while(true) {
+		// Drain the pipe first. Only with an empty pipe EAGAIN on the socket means "no data"
+		while(c->piped > 0) {
+			ssize_t len = splice(c->pipe[0], NULL, c->fd, NULL, c->piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if(len < 0) {
+				if(errno == EINTR) continue;
+				if(errno == EAGAIN || errno == EWOULDBLOCK) return 0;	// Wait for EPOLLOUT
+				stat_add(&w->stats->tcp_errors, 1);
+				return -1;
+			}
+			c->piped -= (size_t)len;
+		}
+		if(c->eof) return -1;		// Everything sent
+
+		ssize_t len = splice(c->fd, NULL, c->pipe[1], NULL, SPLICE_PIPE_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if(len < 0) {
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			if(errno == EINVAL) {
+				close(c->pipe[0]);
+				close(c->pipe[1]);
+				c->pipe[0] = c->pipe[1] = -1;
+				c->copy = true;
+				return conn_read(w, c);
+			}
+			stat_add(&w->stats->tcp_errors, 1);
+			return -1;
+		} else if(len == 0) {
+			c->eof = true;
+			continue;
+		}
+		c->piped += (size_t)len;
+		stat_add(&w->stats->tcp_bytes, (size_t)len);
+		stat_add(&w->stats->tcp_packets, 1);
+	}
+}
+
+static void * epoll_worker(void * args) {
+	epoll_worker_t *w = (epoll_worker_t*)args;
+	struct epoll_event events[EPOLL_EVENTS];
+
+	pin_thread(w->cpu);
+	w->stats = stats_slot();
+	while(running) {
+		int n = epoll_wait(w->epfd, events, EPOLL_EVENTS, busy_poll ? 0 : 1000);
+		if(n < 0) {
+			if(errno == EINTR) continue;
+			fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+			break;
+		}
+		if(n == 0 && busy_poll) {
+			sched_yield();
+			continue;
+		}
+		for(int i=0;i<n;i++) {
+			conn_t *c = (conn_t*)events[i].data.ptr;
+			const uint32_t ev = events[i].events;
+
+			if(ev & EPOLLERR) {
+				stat_add(&w->stats->tcp_errors, 1);
+				conn_close(w, c);
+				continue;
+			}
+			if(use_splice && !c->copy) {
+				if(conn_splice(w, c) < 0) conn_close(w, c);
+				continue;
+			}
+			if((ev & EPOLLOUT) && c->out_len > 0) {
+				if(conn_flush(c) < 0) {
+					stat_add(&w->stats->tcp_errors, 1);
+					conn_close(w, c);
+					continue;
+				}
+			}
+			if(c->eof) {
+				if(c->out_len == 0) conn_close(w, c);
+				continue;
+			}
+			if((ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) || (c->rd_blocked && c->out_len < (size_t)CONN_OUTBUF_MAX)) {
+				if(conn_read(w, c) < 0) conn_close(w, c);
+			}
+		}
+	}
+	close(w->epfd);
+	return NULL;
+}
+
+int epoll_engine_start(int n) {
+	const int cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	workers = (epoll_worker_t*)calloc((size_t)n, sizeof(epoll_worker_t));
+	if(workers == NULL) {
+		errno = ENOMEM;
+		return -ENOMEM;
+	}
+	for(int i=0;i<n;i++) {
+		epoll_worker_t *w = &workers[i];
+		w->cpu = (cpus > 0) ? i % cpus : 0;
+		w->epfd = epoll_create1(0);
+		if(w->epfd < 0) return -1;
+		int rc = pthread_create(&w->tid, NULL, epoll_worker, w);
+		if(rc != 0) {
+			close(w->epfd);
+			errno = rc;
+			return -1;
+		}
+		workers_count++;
+	}
+	return 0;
+}
+
+void epoll_engine_join() {
+	for(int i=0;i<workers_count;i++)
+		pthread_join(workers[i].tid, NULL);
+	free(workers);
+	workers = NULL;
+	workers_count = 0;
+}
+
+/** Hand a new connection to the next epoll worker (round robin) */
+static int epoll_engine_add(const int sock) {
+	static int next = 0;
+	epoll_worker_t *w = &workers[next];
+	next = (next + 1) % workers_count;
+
+	conn_t *c = (conn_t*)calloc(1, sizeof(conn_t));
+	if(c == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	c->fd = sock;
+	c->pipe[0] = c->pipe[1] = -1;
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = c;
+	if(epoll_ctl(w->epfd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+		free(c);
+		return -1;
+	}
+	return 0;
+}
+
+/* ==== batched udp echo ==================================================== */
+
+static int log2i(unsigned int v) {
+	int ret = 0;
+	while(v >>= 1) ret++;
+	return ret;
+}
+
+/** Echo datagrams with recvmmsg/sendmmsg using batches of up to udp_batch datagrams */
+static void udp_echo_batched(const int fd, worker_stats_t *st) {
+	const unsigned int n = (unsigned int)udp_batch;
+
+	// Preallocate everything once: buffers, iovecs, addresses and message headers
+	char *bufs = (char*)malloc(n * BUF_SIZE);
+	struct iovec *iovs = (struct iovec*)calloc(n, sizeof(struct iovec));
+	struct sockaddr_in *addrs = (struct sockaddr_in*)calloc(n, sizeof(struct sockaddr_in));
+	struct mmsghdr *msgs = (struct mmsghdr*)calloc(n, sizeof(struct mmsghdr));
+	if(bufs == NULL || iovs == NULL || addrs == NULL || msgs == NULL) {
+		fprintf(stderr, "out of memory");
+		goto finish;
+	}
+	for(unsigned int i=0;i<n;i++) {
+		iovs[i].iov_base = bufs + i*BUF_SIZE;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &addrs[i];
+	}
+
+	while(running) {
+		for(unsigned int i=0;i<n;i++) {
+			iovs[i].iov_len = BUF_SIZE;
+			msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		}
+		// Block (or spin) for the first datagram, then take whatever else is queued
+		int count = recvmmsg(fd, msgs, n, busy_poll ? MSG_DONTWAIT : MSG_WAITFORONE, NULL);
+		if(!running) goto finish;
+		if(count < 0) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				if(busy_poll) sched_yield();
+				continue;
+			}
+			if(errno == EINTR) continue;
+			fprintf(stderr, "udp receive error: %s\n", strerror(errno));
+			stat_add(&st->udp_errors, 1);
+			goto finish;
+		} else if(count == 0) continue;
+
+		size_t bytes = 0;
+		for(int i=0;i<count;i++) {
+			iovs[i].iov_len = msgs[i].msg_len;
+			bytes += msgs[i].msg_len;
+		}
+		stat_add(&st->batches, 1);
+		stat_add(&st->udp_packets, (size_t)count);
+		if((unsigned int)count == n) stat_add(&st->batch_full, 1);
+		stat_add(&st->batch_hist[log2i((unsigned int)count)], 1);
+
+		// Reply to all of them, sendmmsg might send less than requested
+		int sent = 0;
+		while(sent < count) {
+			int rc = sendmmsg(fd, msgs + sent, (unsigned int)(count - sent), MSG_DONTWAIT);
+			if(rc < 0) {
+				if(errno == EINTR) continue;
+				if(errno != EAGAIN && errno != EWOULDBLOCK) {
+					fprintf(stderr, "udp send error: %s\n", strerror(errno));
+					stat_add(&st->udp_errors, 1);
+				}
+				// Drop the remaining replies (or the failing one) but keep serving
+				for(int i=sent;i<count;i++) bytes -= msgs[i].msg_hdr.msg_iov->iov_len;
+				stat_add(&st->udp_dropped, (size_t)(count - sent));
+				break;
+			}
+			sent += rc;
+		}
+		stat_add(&st->udp_bytes, bytes);
+	}
+
+finish:
+	free(bufs);
+	free(iovs);
+	free(addrs);
+	free(msgs);
+}
+
+/* ==== io_uring engine ===================================================== */
+
+#ifdef HAVE_IO_URING
+
+#define UR_ENTRIES 1024			// Submission queue entries
+#define UR_BUFS 1024			// Provided buffers per ring (power of 2)
+#define UR_BUF_SIZE 16384L		// Size of a provided buffer
+#define UR_BGID 0				// Buffer group id
+
+/** Operations, stored in the lower bits of the user_data */
+enum { UR_ACCEPT = 0, UR_RECV, UR_SEND, UR_RECVMSG, UR_SENDMSG };
+#define UR_OP_BITS 3
+#define UR_OP_MASK ((1ULL << UR_OP_BITS) - 1ULL)
+
+/** Raw io_uring with a ring of provided buffers */
+typedef struct {
+	int fd;
+	bool sqpoll;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_flags, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned sq_entries;
+	unsigned sqe_tail;		// Local tail, published on submit
+	void *sq_ptr, *cq_ptr;
+	size_t sq_size, cq_size, sqes_size;
+
+	struct io_uring_buf_ring *br;
+	size_t br_size;
+	unsigned short br_tail;
+	char *bufs;
+	uint16_t *next;			// Per buffer: Next buffer queued on the same connection
+	uint32_t *len;			// Per buffer: Bytes to send
+	uint32_t *off;			// Per buffer: Bytes already sent
+	struct msghdr *msgs;	// Per buffer: udp reply header
+	struct iovec *iovs;
+	struct msghdr tmpl;		// Multishot recvmsg template
+} uring_t;
+
+/** tcp connection of the io_uring engine. Received buffers are queued and sent one at a time, to keep the order */
+typedef struct uconn {
+	int fd;
+	int head, tail;			// Queue of buffers to send, -1 if empty
+	bool sending;			// A send is in flight
+	bool recv_armed;		// The multishot recv is active
+	bool eof;
+	struct uconn *starved;	// Next connection waiting for free buffers
+} uconn_t;
+
+static void uring_free(uring_t *u) {
+	if(u->sqes != NULL) munmap(u->sqes, u->sqes_size);
+	if(u->cq_ptr != NULL && u->cq_ptr != u->sq_ptr) munmap(u->cq_ptr, u->cq_size);
+	if(u->sq_ptr != NULL) munmap(u->sq_ptr, u->sq_size);
+	if(u->br != NULL) munmap(u->br, u->br_size);
+	if(u->fd > 0) close(u->fd);
+	free(u->bufs);
+	free(u->next);
+	free(u->len);
+	free(u->off);
+	free(u->msgs);
+	free(u->iovs);
+}
+
+static int uring_setup(uring_t *u, const bool sqpoll) {
+	struct io_uring_params p;
+	bzero(&p, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = UR_ENTRIES * 4;
+	if(sqpoll) {
+		p.flags |= IORING_SETUP_SQPOLL;
+		p.sq_thread_idle = 1000;
+	}
+	u->sqpoll = sqpoll;
+	u->fd = (int)syscall(__NR_io_uring_setup, UR_ENTRIES, &p);
+	if(u->fd < 0) return -1;
+	if(!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP)) {
+		errno = ENOSYS;
+		return -1;
+	}
+
+	u->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		if(u->cq_size > u->sq_size) u->sq_size = u->cq_size;
+		u->cq_size = u->sq_size;
+	}
+	u->sq_ptr = mmap(NULL, u->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if(u->sq_ptr == MAP_FAILED) {
+		u->sq_ptr = NULL;
+		return -1;
+	}
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_ptr = u->sq_ptr;
+	} else {
+		u->cq_ptr = mmap(NULL, u->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if(u->cq_ptr == MAP_FAILED) {
+			u->cq_ptr = NULL;
+			return -1;
+		}
+	}
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = (struct io_uring_sqe*)mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if(u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		return -1;
+	}
+
+	char *sq = (char*)u->sq_ptr;
+	char *cq = (char*)u->cq_ptr;
+	u->sq_head = (unsigned*)(sq + p.sq_off.head);
+	u->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+	u->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+	u->sq_flags = (unsigned*)(sq + p.sq_off.flags);
+	u->sq_array = (unsigned*)(sq + p.sq_off.array);
+	u->cq_head = (unsigned*)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+	u->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+	u->sq_entries = p.sq_entries;
+	u->sqe_tail = *u->sq_tail;
+	return 0;
+}
+
+static void uring_buf_recycle(uring_t *u, const uint16_t bid) {
+	struct io_uring_buf *buf = &u->br->bufs[u->br_tail & (UR_BUFS - 1)];
+	buf->addr = (uint64_t)(uintptr_t)(u->bufs + bid * UR_BUF_SIZE);
+	buf->len = (uint32_t)UR_BUF_SIZE;
+	buf->bid = bid;
+	u->br_tail++;
+	__atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+/** Allocate and register the provided buffer ring */
+static int uring_buffers(uring_t *u) {
+	u->br_size = UR_BUFS * sizeof(struct io_uring_buf);
+	u->br = (struct io_uring_buf_ring*)mmap(NULL, u->br_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(u->br == MAP_FAILED) {
+		u->br = NULL;
+		return -1;
+	}
+	u->bufs = (char*)malloc(UR_BUFS * UR_BUF_SIZE);
+	u->next = (uint16_t*)calloc(UR_BUFS, sizeof(uint16_t));
+	u->len = (uint32_t*)calloc(UR_BUFS, sizeof(uint32_t));
+	u->off = (uint32_t*)calloc(UR_BUFS, sizeof(uint32_t));
+	u->msgs = (struct msghdr*)calloc(UR_BUFS, sizeof(struct msghdr));
+	u->iovs = (struct iovec*)calloc(UR_BUFS, sizeof(struct iovec));
+	if(u->bufs == NULL || u->next == NULL || u->len == NULL || u->off == NULL || u->msgs == NULL || u->iovs == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	struct io_uring_buf_reg reg;
+	bzero(&reg, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)u->br;
+	reg.ring_entries = UR_BUFS;
+	reg.bgid = UR_BGID;
+	if(syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) return -1;
+	u->br_tail = 0;
+	for(uint16_t i=0;i<UR_BUFS;i++) uring_buf_recycle(u, i);
+	return 0;
+}
+
+/** Publish the queued sqes and wait for at least wait completions (max. 1 second, so that we notice a shutdown) */
+static int uring_submit(uring_t *u, const unsigned wait) {
+	const unsigned submit = u->sqe_tail - *u->sq_tail;
+	__atomic_store_n(u->sq_tail, u->sqe_tail, __ATOMIC_RELEASE);
+
+	unsigned flags = 0;
+	unsigned to_submit = submit;
+	if(u->sqpoll) {
+		// The kernel thread picks up new entries by itself, unless it went idle
+		to_submit = 0;
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if(__atomic_load_n(u->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP)
+			flags |= IORING_ENTER_SQ_WAKEUP;
+		if(flags == 0 && wait == 0) return 0;
+	} else if(submit == 0 && wait == 0) return 0;
+
+	struct __kernel_timespec ts;
+	ts.tv_sec = 1;
+	ts.tv_nsec = 0;
+	struct io_uring_getevents_arg arg;
+	bzero(&arg, sizeof(arg));
+	arg.ts = (uint64_t)(uintptr_t)&ts;
+	if(wait > 0) flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+	int rc = (int)syscall(__NR_io_uring_enter, u->fd, to_submit, wait, flags, (wait > 0) ? &arg : NULL, (wait > 0) ? sizeof(arg) : 0);
+	if(rc < 0 && (errno == ETIME || errno == EINTR || errno == EBUSY || errno == EAGAIN)) return 0;
+	return rc;
+}
+
+static struct io_uring_sqe * uring_sqe(uring_t *u, const int op, const int fd, const void *addr, const unsigned len, const uint64_t data) {
+	while(u->sqe_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+		if(uring_submit(u, 0) < 0) return NULL;
+	}
+	const unsigned idx = u->sqe_tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[idx];
+	bzero(sqe, sizeof(*sqe));
+	sqe->opcode = (uint8_t)op;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)addr;
+	sqe->len = len;
+	sqe->user_data = data;
+	u->sq_array[idx] = idx;
+	u->sqe_tail++;
+	return sqe;
+}
+
+static void uring_accept(uring_t *u, const int fd) {
+	struct io_uring_sqe *sqe = uring_sqe(u, IORING_OP_ACCEPT, fd, NULL, 0, UR_ACCEPT);
+	if(sqe == NULL) return;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+static void uring_recv(uring_t *u, uconn_t *c) {
+	struct io_uring_sqe *sqe = uring_sqe(u, IORING_OP_RECV, c->fd, NULL, 0, (uint64_t)(uintptr_t)c | UR_RECV);
+	if(sqe == NULL) return;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = UR_BGID;
+	c->recv_armed = true;
+}
+
+static void uring_send(uring_t *u, uconn_t *c) {
+	const int bid = c->head;
+	struct io_uring_sqe *sqe = uring_sqe(u, IORING_OP_SEND, c->fd, u->bufs + bid * UR_BUF_SIZE + u->off[bid], u->len[bid] - u->off[bid], (uint64_t)(uintptr_t)c | UR_SEND);
+	if(sqe == NULL) return;
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+	c->sending = true;
+}
+
+static void uring_recvmsg(uring_t *u, const int fd) {
+	struct io_uring_sqe *sqe = uring_sqe(u, IORING_OP_RECVMSG, fd, &u->tmpl, 0, UR_RECVMSG);
+	if(sqe == NULL) return;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = UR_BGID;
+}
+
+static void uconn_close_if_done(uconn_t *c, worker_stats_t *st) {
+	if(c->eof && !c->sending && !c->recv_armed && c->starved == NULL) {
+		stat_add(&st->tcp_closed, 1);
+		close(c->fd);
+		free(c);
+	}
+}
+
+/** Serve the given (listening tcp or bound udp) socket with io_uring */
+static void uring_loop(const int fd, const bool udp, worker_stats_t *st) {
+	uring_t u;
+	bzero(&u, sizeof(u));
+	uconn_t *starved = NULL;		// tcp connections waiting for free buffers
+	bool udp_starved = false;
+	// Sentinel for the end of the starved list, so that starved != NULL marks a queued connection
+	uconn_t end;
+
+	if(uring_setup(&u, uring_sqpoll) < 0 || uring_buffers(&u) < 0) {
+		fprintf(stderr, "io_uring setup failed: %s\n", strerror(errno));
+		uring_free(&u);
+		return;
+	}
+	u.tmpl.msg_namelen = sizeof(struct sockaddr_in);
+	if(udp)
+		uring_recvmsg(&u, fd);
+	else
+		uring_accept(&u, fd);
+
+	while(running) {
+		unsigned head = *u.cq_head;
+		const unsigned tail = __atomic_load_n(u.cq_tail, __ATOMIC_ACQUIRE);
+		if(head == tail) {
+			if(uring_submit(&u, busy_poll ? 0 : 1) < 0) {
+				fprintf(stderr, "io_uring_enter failed: %s\n", strerror(errno));
+				break;
+			}
+			continue;
+		}
+
+		bool recycled = false;
+		for(;head != tail;head++) {
+			const struct io_uring_cqe *cqe = &u.cqes[head & *u.cq_mask];
+			const int res = cqe->res;
+			const bool more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+			const uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+			uconn_t *c = (uconn_t*)(uintptr_t)(cqe->user_data & ~UR_OP_MASK);
+
+			switch(cqe->user_data & UR_OP_MASK) {
+				case UR_ACCEPT:
+					if(res >= 0) {
+						int one = 1;
+						if(setsockopt(res, IPPROTO_TCP, TCP_NODELAY, (char *)&one, sizeof(int)) < 0)
+							fprintf(stderr, "Warning: Failed to set TCP_NODELAY for new socket: %s\n", strerror(errno));
+						if(busy_poll) setup_busy_poll(res);
+						stat_add(&st->tcp_accepted, 1);
+						c = (uconn_t*)calloc(1, sizeof(uconn_t));
+						if(c == NULL) {
+							stat_add(&st->tcp_closed, 1);
+							close(res);
+						} else {
+							c->fd = res;
+							c->head = c->tail = -1;
+							uring_recv(&u, c);
+						}
+					} else if(running) {
+						fprintf(stderr, "accept error: %s\n", strerror(-res));
+					}
+					if(!more && running) uring_accept(&u, fd);
+					break;
+				case UR_RECV:
+					if(res > 0) {
+						u.len[bid] = (uint32_t)res;
+						u.off[bid] = 0;
+						if(c->head < 0)
+							c->head = bid;
+						else
+							u.next[c->tail] = bid;
+						c->tail = bid;
+						if(!c->sending) uring_send(&u, c);
+						stat_add(&st->tcp_bytes, (size_t)res);
+						stat_add(&st->tcp_packets, 1);
+					}
+					if(!more) {
+						c->recv_armed = false;
+						if(res == -ENOBUFS) {
+							// Out of buffers: rearm once the pending sends returned some
+							c->starved = (starved == NULL) ? &end : starved;
+							starved = c;
+						} else if(res > 0) {
+							uring_recv(&u, c);
+						} else {
+							c->eof = true;
+							uconn_close_if_done(c, st);
+						}
+					}
+					break;
+				case UR_SEND:
+					c->sending = false;
+					if(res < 0) {
+						// Drop everything and let the recv terminate
+						stat_add(&st->tcp_errors, 1);
+						for(int b = c->head;b >= 0;b = (b == c->tail) ? -1 : u.next[b]) uring_buf_recycle(&u, (uint16_t)b);
+						c->head = c->tail = -1;
+						recycled = true;
+						c->eof = true;
+						shutdown(c->fd, SHUT_RDWR);
+					} else {
+						const int b = c->head;
+						u.off[b] += (uint32_t)res;
+						if(u.off[b] >= u.len[b]) {
+							c->head = (b == c->tail) ? -1 : u.next[b];
+							if(c->head < 0) c->tail = -1;
+							uring_buf_recycle(&u, (uint16_t)b);
+							recycled = true;
+						}
+						if(c->head >= 0) uring_send(&u, c);
+					}
+					uconn_close_if_done(c, st);
+					break;
+				case UR_RECVMSG:
+					if(res >= 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+						char *buf = u.bufs + bid * UR_BUF_SIZE;
+						const struct io_uring_recvmsg_out *out = (const struct io_uring_recvmsg_out*)buf;
+						char *name = buf + sizeof(struct io_uring_recvmsg_out);
+						char *payload = name + u.tmpl.msg_namelen;
+						size_t len = out->payloadlen;
+						if(len > (size_t)(buf + UR_BUF_SIZE - payload)) len = (size_t)(buf + UR_BUF_SIZE - payload);
+
+						u.iovs[bid].iov_base = payload;
+						u.iovs[bid].iov_len = len;
+						u.msgs[bid].msg_name = name;
+						u.msgs[bid].msg_namelen = out->namelen;
+						u.msgs[bid].msg_iov = &u.iovs[bid];
+						u.msgs[bid].msg_iovlen = 1;
+						if(uring_sqe(&u, IORING_OP_SENDMSG, fd, &u.msgs[bid], 1, ((uint64_t)bid << UR_OP_BITS) | UR_SENDMSG) == NULL)
+							uring_buf_recycle(&u, bid);
+						stat_add(&st->udp_bytes, len);
+						stat_add(&st->udp_packets, 1);
+					} else if(res < 0 && res != -ENOBUFS && running) {
+						fprintf(stderr, "udp receive error: %s\n", strerror(-res));
+						stat_add(&st->udp_errors, 1);
+					}
+					if(!more && running) {
+						if(res == -ENOBUFS)
+							udp_starved = true;
+						else
+							uring_recvmsg(&u, fd);
+					}
+					break;
+				case UR_SENDMSG:
+					if(res < 0) stat_add(&st->udp_dropped, 1);
+					uring_buf_recycle(&u, (uint16_t)(cqe->user_data >> UR_OP_BITS));
+					recycled = true;
+					break;
+			}
+		}
+		__atomic_store_n(u.cq_head, head, __ATOMIC_RELEASE);
+
+		if(recycled) {
+			if(udp_starved) {
+				udp_starved = false;
+				uring_recvmsg(&u, fd);
+			}
+			while(starved != NULL && starved != &end) {
+				uconn_t *c = starved;
+				starved = c->starved;
+				c->starved = NULL;
+				if(c->eof)
+					uconn_close_if_done(c, st);
+				else
+					uring_recv(&u, c);
+			}
+			if(starved == &end) starved = NULL;
+		}
+		if(uring_submit(&u, 0) < 0) {
+			fprintf(stderr, "io_uring_enter failed: %s\n", strerror(errno));
+			break;
+		}
+	}
+
+	uring_free(&u);
+}
+
+#endif
+
 void * server_thread(void * args) {
 	// Make parameters thread-local and free memory
 	s_thread_params_t *params = (s_thread_params_t*)args;
 	const int fd = params->sock;
 	const bool udp = params->udp;
+	const int cpu = params->cpu;
 	free(params);
 
-	if (udp) {
+	if(cpu >= 0) pin_thread(cpu);
+	worker_stats_t *st = stats_slot();
+
+#ifdef HAVE_IO_URING
+	if (engine == ENGINE_URING) {
+		if(!udp && listen(fd, 128) < 0) {
+			fprintf(stderr, "listening failed: %s\n", strerror(errno));
+			goto finish;
+		}
+		uring_loop(fd, udp, st);
+		goto finish;
+	}
+#endif
+	if (udp && udp_batch > 1) {
+		udp_echo_batched(fd, st);
+	} else if (udp) {
 		char buf[BUF_SIZE];
 		
 		while(true) {
 			struct sockaddr_in src_addr;
 			socklen_t addrlen = sizeof(src_addr);
-			ssize_t len = recvfrom(fd, buf, BUF_SIZE, MSG_WAITALL, (struct sockaddr*)&src_addr, &addrlen);
+			ssize_t len = recvfrom(fd, buf, BUF_SIZE, busy_poll ? MSG_DONTWAIT : MSG_WAITALL, (struct sockaddr*)&src_addr, &addrlen);
 			if(!running) goto finish;
+			if(len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+				if(busy_poll) sched_yield();
+				continue;
+			}
 			if(len <= 0) {
 				fprintf(stderr, "udp receive error: %s\n", strerror(errno));
+				stat_add(&st->udp_errors, 1);
 				goto finish;
 			}
 			int flags = MSG_DONTWAIT;
 			len = sendto(fd, buf, len, flags, (const struct sockaddr *)&src_addr, addrlen);
 			if(len <= 0) {
-				fprintf(stderr, "udp send error: %s\n", strerror(errno));
-				goto finish;
+				// Drop the reply but keep serving, as the batched path does
+				if(errno != EAGAIN && errno != EWOULDBLOCK) {
+					fprintf(stderr, "udp send error: %s\n", strerror(errno));
+					stat_add(&st->udp_errors, 1);
+				}
+				stat_add(&st->udp_dropped, 1);
+				continue;
 			}
-			bytes_udp += len;		// TODO: atomic increment
+			stat_add(&st->udp_bytes, (size_t)len);
+			stat_add(&st->udp_packets, 1);
 		} 
 	} else {
 		// I am a listener server
@@ -243,12 +1687,33 @@ void * server_thread(void * args) {
 		}
 
 		while(true) {
-			const int sock = accept(fd, NULL, NULL);
+			const int flags = (engine == ENGINE_EPOLL) ? SOCK_NONBLOCK : 0;
+			const int sock = accept4(fd, NULL, NULL, flags);
 			if(!running) goto finish;
-			if(sock <= 0) {
+			if(sock < 0) {
+				if(errno == EINTR || errno == ECONNABORTED) continue;
 				fprintf(stderr, "accept error: %s\n", strerror(errno));
+				if(errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+					usleep(10000);	// Out of resources. Back off and retry
+					continue;
+				}
 				goto finish;
 			}
+			stat_add(&st->tcp_accepted, 1);
+
+			if(engine == ENGINE_EPOLL) {
+				// Disable Nagle's algorithm
+				int one = 1;
+				if(setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *)&one, sizeof(int)) < 0)
+					fprintf(stderr, "Warning: Failed to set TCP_NODELAY for new socket: %s\n", strerror(errno));
+				if(busy_poll) setup_busy_poll(sock);
+				if(epoll_engine_add(sock) < 0) {
+					fprintf(stderr, "error adding connection: %s\n", strerror(errno));
+					stat_add(&st->tcp_closed, 1);
+					close(sock);
+				}
+				continue;
+			}
 
 			// Background thread
 			pthread_t tid;
@@ -259,6 +1724,7 @@ void * server_thread(void * args) {
 			}
 			params->sock = sock;
 			params->udp = false;
+			params->cpu = -1;
 			int rc = pthread_create(&tid, NULL, tcp_client, params);
 			if(rc < 0) {
 				free(params);
@@ -274,7 +1740,7 @@ finish:
 	return NULL;
 }
 
-static int create_server_thread(int sock, bool udp, pthread_t *tid) {
+static int create_server_thread(int sock, bool udp, int cpu, pthread_t *tid) {
 	s_thread_params_t *params = (s_thread_params_t*)malloc(sizeof(s_thread_params_t));
 	if(params == NULL) {
 		errno = ENOMEM;
@@ -282,6 +1748,7 @@ static int create_server_thread(int sock, bool udp, pthread_t *tid) {
 	}
 	params->sock = sock;
 	params->udp = udp;
+	params->cpu = cpu;
 	int rc = pthread_create(tid, NULL, server_thread, params);
 	if(rc < 0) {
 		free(params);
@@ -290,26 +1757,61 @@ static int create_server_thread(int sock, bool udp, pthread_t *tid) {
 	return rc;
 }
 
-int udp_server(const int port, pthread_t *pid, int *sock) {
-	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+/** Attach a reuseport program, that selects the socket with the index of the receiving cpu */
+static int attach_cpu_steering(const int fd, const int n) {
+	struct sock_filter code[] = {
+		{ BPF_LD  | BPF_W | BPF_ABS, 0, 0, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU) },	// A = current cpu
+		{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)n },					// A = A % n
+		{ BPF_RET | BPF_A, 0, 0, 0 },										// return A
+	};
+	struct sock_fprog prog;
+	prog.len = sizeof(code)/sizeof(code[0]);
+	prog.filter = code;
+	return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+
+int udp_server(const int port, const int n) {
+	const int cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
 	int rc = 0;
-	if(fd < 0) return fd;
 
-	struct sockaddr_in addr;
-	bzero(&addr, sizeof(addr));
-	addr.sin_family    = AF_INET; // IPv4 
-    addr.sin_addr.s_addr = INADDR_ANY; 
-    addr.sin_port = htons(port); 
+	// Sockets are bound in order, so the index in the reuseport group is the worker index
+	for(int i=0;i<n;i++) {
+		int fd = socket(AF_INET, SOCK_DGRAM, 0);
+		if(fd < 0) return fd;
+		const int cpu = ((n > 1 || busy_poll) && cpus > 0) ? i % cpus : -1;
 
-    rc = bind(fd, (const struct sockaddr*)&addr, sizeof(addr));
-    if(rc < 0) goto fail;
-    rc = create_server_thread(fd, true, pid);
-    if(rc < 0) goto fail;
+		if(n > 1) {
+			int one = 1;
+			rc = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+			if(rc < 0) goto fail;
+			if(steer == STEER_CPU && setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) < 0)
+				fprintf(stderr, "Warning: Failed to set SO_INCOMING_CPU: %s\n", strerror(errno));
+		}
 
-    *sock = fd;
-    return rc;
+		if(busy_poll) setup_busy_poll(fd);
+
+		struct sockaddr_in addr;
+		bzero(&addr, sizeof(addr));
+		addr.sin_family    = AF_INET; // IPv4 
+		addr.sin_addr.s_addr = INADDR_ANY; 
+		addr.sin_port = htons(port); 
+
+		rc = bind(fd, (const struct sockaddr*)&addr, sizeof(addr));
+		if(rc < 0) goto fail;
+		if(n > 1 && i == 0 && steer == STEER_CBPF) {
+			rc = attach_cpu_steering(fd, n);
+			if(rc < 0) goto fail;
+		}
+		rc = create_server_thread(fd, true, cpu, &udp_tids[i]);
+		if(rc < 0) goto fail;
+
+		udp_socks[udp_socks_count++] = fd;
+		if(sock_udp == 0) sock_udp = fd;
+		continue;
 fail:
-	close(fd);
+		close(fd);
+		return rc;
+	}
 	return rc;
 }
 
@@ -326,7 +1828,7 @@ int tcp_server(const int port, pthread_t *pid, int *sock) {
 
     rc = bind(fd, (const struct sockaddr*)&addr, sizeof(addr));
     if(rc < 0) goto fail;
-    rc = create_server_thread(fd, false, pid);
+    rc = create_server_thread(fd, false, -1, pid);
     if(rc < 0) goto fail;
 
     *sock = fd;
@@ -345,21 +1847,22 @@ void sig_handler(int signo) {
 			running = false;
 
 			fprintf(stderr, "SIGINT received\n");
-			if(sock_udp > 0) shutdown(sock_udp, SHUT_RDWR);
+			for(int i=0;i<udp_socks_count;i++) shutdown(udp_socks[i], SHUT_RDWR);
 			if(sock_tcp > 0) shutdown(sock_tcp, SHUT_RDWR);
 			return;
 		case SIGTERM:
 			emergency = true;
 			running = false;
-			if(sock_udp > 0) shutdown(sock_udp, SHUT_RDWR);
+			for(int i=0;i<udp_socks_count;i++) shutdown(udp_socks[i], SHUT_RDWR);
 			if(sock_tcp > 0) shutdown(sock_tcp, SHUT_RDWR);
 			exit(EXIT_FAILURE);
 			return;
 		case SIGUSR1:
-			if (sock_udp > 0)
-				printf("udp:%d - %ld bytes\n", port, bytes_udp);
-			if (sock_tcp > 0)
-				printf("tcp:%d - %ld bytes\n", port, bytes_tcp);
+			// Printing is done by the monitor thread, only async-signal-safe calls here
+			if(sig_pipe[1] >= 0) {
+				const char c = 1;
+				if(write(sig_pipe[1], &c, 1) < 0) return;
+			}
 			return;
 	}
 }
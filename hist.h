@@ -0,0 +1,99 @@
+/* =============================================================================
+ *
+ * Title:         High dynamic range latency histogram for the pingpong tools
+ * Author:        Felix Niederwanger
+ * License:       Copyright (c), 2019 Felix Niederwanger
+ *                MIT license (http://opensource.org/licenses/MIT)
+ *
+ * Log-linear buckets as in HdrHistogram: Values below 2^HIST_SUB_BITS are
+ * exact, above every power of two is split into 2^HIST_SUB_BITS linear
+ * buckets, so every recorded value is accurate to 1/2^HIST_SUB_BITS (< 1 %).
+ * The whole 64-bit range fits into a fixed array, recording is a clz, a
+ * shift and an increment. Histograms are not thread-safe: Every thread
+ * records into its own and they are merged with hist_merge.
+ *
+ * =============================================================================
+ */
+
+#ifndef _PINGPONG_HIST_H_
+#define _PINGPONG_HIST_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#define HIST_SUB_BITS 7
+#define HIST_SUB (1UL << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct {
+	uint64_t count;				// Recorded values
+	uint64_t min;
+	uint64_t max;
+	double sum;					// For the average
+	uint64_t buckets[HIST_BUCKETS];
+} hist_t;
+
+/** Clear the histogram */
+static inline void hist_reset(hist_t *hist) {
+	memset(hist, 0, sizeof(hist_t));
+}
+
+/** Bucket of a value */
+static inline unsigned int hist_index(const uint64_t value) {
+	if(value < HIST_SUB) return (unsigned int)value;
+	const unsigned int shift = 63 - __builtin_clzl(value) - HIST_SUB_BITS;
+	return (shift + 1) * HIST_SUB + (unsigned int)((value >> shift) - HIST_SUB);
+}
+
+/** Highest value that falls into the given bucket */
+static inline uint64_t hist_value(const unsigned int index) {
+	if(index < HIST_SUB) return index;
+	const unsigned int shift = index / HIST_SUB - 1;
+	return ((HIST_SUB + index % HIST_SUB + 1) << shift) - 1;
+}
+
+/** Record a value, negative values (errors) are ignored */
+static inline void hist_record(hist_t *hist, const long value) {
+	if(value < 0) return;
+	const uint64_t v = (uint64_t)value;
+	if(hist->count == 0 || v < hist->min) hist->min = v;
+	if(v > hist->max) hist->max = v;
+	hist->count++;
+	hist->sum += (double)v;
+	hist->buckets[hist_index(v)]++;
+}
+
+/** Add all values of src to dst */
+static inline void hist_merge(hist_t *dst, const hist_t *src) {
+	if(src->count == 0) return;
+	if(dst->count == 0 || src->min < dst->min) dst->min = src->min;
+	if(src->max > dst->max) dst->max = src->max;
+	dst->count += src->count;
+	dst->sum += src->sum;
+	for(unsigned int i=0;i<HIST_BUCKETS;i++) dst->buckets[i] += src->buckets[i];
+}
+
+/** Value below which the given percentile (0-100) of all recorded values are, within the
+  * precision of the histogram. Percentiles of an empty histogram are 0 */
+static inline uint64_t hist_percentile(const hist_t *hist, const double percentile) {
+	if(hist->count == 0) return 0;
+	const double exact = percentile / 100.0 * (double)hist->count;
+	uint64_t rank = (uint64_t)exact;
+	if((double)rank < exact || rank < 1) rank++;		// ceil, the first value is rank 1
+	uint64_t seen = 0;
+	for(unsigned int i=0;i<HIST_BUCKETS;i++) {
+		seen += hist->buckets[i];
+		if(seen >= rank) {
+			const uint64_t value = hist_value(i);
+			return (value > hist->max) ? hist->max : (value < hist->min) ? hist->min : value;
+		}
+	}
+	return hist->max;
+}
+
+/** Average of all recorded values */
+static inline double hist_avg(const hist_t *hist) {
+	return (hist->count > 0) ? hist->sum / (double)hist->count : 0;
+}
+
+#endif
@@ -26,6 +26,8 @@
 #include <sys/types.h>
 #include <netdb.h> 
 #include <sys/time.h>
+#include "timing.h"
+#include "hist.h"
 #include <netinet/tcp.h>
 
 // Number of runs per series
@@ -34,6 +36,9 @@
 static char *remote = "";
 static int port = 7;
 static int iterations = 10;
+static bool tsc = false;
+static hist_t hist;				// Round trip times of the current size
+static const double percentiles[] = { 50, 90, 99, 99.9, 99.99 };
 
 
 static void udp_tests(const struct sockaddr_in *remote);
@@ -58,6 +63,7 @@ int main(int argc, char** argv) {
 				printf("OPTIONS\n");
 				printf("  -h, --help                 Print this help message\n");
 				printf("  -i, --iterations N         Set number of iterations (default: 10)\n");
+				printf("  --tsc                      Use the calibrated TSC as clock source (x86 with invariant TSC)\n");
 				printf("REMOTE:PORT must be an endpoint with 'echo' running (tcp+udp)\n");
 				printf("\n");
 				printf("https://github.com/grisu48/pingpong\n");
@@ -65,6 +71,8 @@ int main(int argc, char** argv) {
 			} else if(!strcmp("-i", arg) || !strcmp("--iterations", arg)) {
 				// XXX: Out of bound check
 				iterations = atoi(argv[++i]);
+			} else if(!strcmp("--tsc", arg)) {
+				tsc = true;
 			} else {
 				fprintf(stderr, "Illegal argument: %s\n", arg);
 				printf("Type %s --help if you need help\n", argv[0]);
@@ -78,6 +86,8 @@ int main(int argc, char** argv) {
 		}
 	}
   
+    timing_init(tsc);
+
     struct sockaddr_in addr; 
     memset(&addr, 0, sizeof(addr)); 
     addr.sin_family = AF_INET; 
@@ -90,38 +100,26 @@ int main(int argc, char** argv) {
     exit(EXIT_SUCCESS);
 }
 
-static long a_max(const long* arr, const size_t n) {
-	long ret = arr[0];
-	for(size_t i=0;i<n;i++) {
-		if(arr[i] < 0) continue;
-		if(arr[i] > ret) ret = arr[i];
-	}
-	return ret;
+/** Print one result row: average, best, the percentiles and worst round trip time in ns */
+static void print_row(const long size, const hist_t *hist) {
+	printf("%ld\t%.0f\t%lu", size, hist_avg(hist), hist->min);
+	for(size_t i=0;i<sizeof(percentiles)/sizeof(percentiles[0]);i++)
+		printf("\t%lu", hist_percentile(hist, percentiles[i]));
+	printf("\t%lu\n", hist->max);
 }
 
-static long a_min(const long* arr, const size_t n) {
-	long ret = a_max(arr,n);		// Make sure we don't take -1 by accident!
-	for(size_t i=0;i<n;i++) {
-		if(arr[i] < 0) continue;
-		if(arr[i] < ret) ret = arr[i];
-	}
-	return ret;
+/** Print the table header matching print_row */
+static void print_header() {
+	printf("# Size\tAverage\tBest");
+	for(size_t i=0;i<sizeof(percentiles)/sizeof(percentiles[0]);i++)
+		printf("\tp%g", percentiles[i]);
+	printf("\tWorst [ns]\n");
 }
 
-static double a_avg(const long* arr, const size_t n) {
-	double sum = 0;
-	long elems = 0;
-	for(size_t i=0;i<n;i++) {
-		if(arr[i] < 0) continue;
-		sum += arr[i];
-		elems++;
-	}
-	return sum/(double)elems;
-}
-
-
 
 
+/** Ping n times with udp datagrams of the given length and record every round trip in hist
+  * @returns average round trip time in ns or -1 on error */
 long udp_ping(int sock, const struct sockaddr *addr, size_t len, int n) {
 	char *buf = (char*)malloc(sizeof(char)*len);
 	if(buf == NULL) return -1;
@@ -129,9 +127,9 @@ long udp_ping(int sock, const struct sockaddr *addr, size_t len, int n) {
 
 	memset(buf, 'a', len);
 
-	struct timeval t1, t2, t_delta;
-	gettimeofday(&t1, NULL);
+	const uint64_t t1 = time_ns();
 	for(int i=0;i<n;i++) {
+		const uint64_t t_ping = time_ns();
 		ssize_t slen = sendto(sock, buf, len, MSG_DONTWAIT, addr, sizeof(struct sockaddr_in));
 		if(slen < 0) goto fail;
 		if((size_t)slen != len) {
@@ -143,10 +141,9 @@ long udp_ping(int sock, const struct sockaddr *addr, size_t len, int n) {
 		slen = recvfrom(sock, buf, len, MSG_WAITALL, &src_addr, &addrlen);
 		// NOTE: We can only receive up to MTU size packets as of now
 		if(slen < 0) goto fail;
+		hist_record(&hist, (long)(time_ns() - t_ping));
 	}
-	gettimeofday(&t2, NULL);
-	timersub(&t2, &t1, &t_delta);
-	ret = t_delta.tv_usec + t_delta.tv_sec * 1000L*1000L;
+	ret = (long)(time_ns() - t1);
 
 	free(buf); 
 	return ret/n;
@@ -177,15 +174,17 @@ static void udp_tests(const struct sockaddr_in *remote) {
 
 
 
-	printf("# Size	Average	Best	Worst\n");
+	print_header();
 
 	for(size_t i=0;i<(sizeof(bytes)/sizeof(bytes[0]));i++) {
-		long rtt[SERIES];
-		for(int j=0;j<SERIES;j++) {
-			rtt[j] = udp_ping(sock, (const struct sockaddr*)remote, bytes[i], iterations);
-		}
+		hist_reset(&hist);
+		bool failed = false;
+		for(int j=0;j<SERIES && !failed;j++)
+			failed = udp_ping(sock, (const struct sockaddr*)remote, bytes[i], iterations) < 0;
 
-		printf("%ld\t%.0f\t%ld\t%ld\n", bytes[i], a_avg(rtt, SERIES), a_min(rtt, SERIES), a_max(rtt, SERIES));
+		// An incomplete series would look like a complete row
+		if(failed || hist.count == 0) printf("%ld\terr\n", bytes[i]);
+		else print_row(bytes[i], &hist);
 
 	}
 
@@ -198,15 +197,15 @@ finish:
 long tcp_connect(int sock, const struct sockaddr *remote) {
 	socklen_t addrlen = sizeof(struct sockaddr);
 
-	struct timeval t1, t2, t_delta;
-	gettimeofday(&t1, NULL);
+	const uint64_t t1 = time_ns();
 	int rc = connect(sock, (const struct sockaddr *)remote, addrlen);
-	gettimeofday(&t2, NULL);
+	const uint64_t t2 = time_ns();
 	if(rc < 0) return -1;
-	timersub(&t2, &t1, &t_delta);
-	return (t_delta.tv_usec + t_delta.tv_sec * 1000L*1000L);
+	return (long)(t2 - t1);
 }
 
+/** Ping n times with messages of the given length and record every round trip in hist
+  * @returns average round trip time in ns or -1 on error */
 long tcp_ping(int sock, size_t len, int n) {
 	char *buf = (char*)malloc(sizeof(char)*len);
 	if(buf == NULL) return -1;
@@ -214,9 +213,9 @@ long tcp_ping(int sock, size_t len, int n) {
 
 	memset(buf, 'a', len);
 
-	struct timeval t1, t2, t_delta;
-	gettimeofday(&t1, NULL);
+	const uint64_t t1 = time_ns();
 	for(int i=0;i<n;i++) {
+		const uint64_t t_ping = time_ns();
 		ssize_t slen = send(sock, buf, len, MSG_DONTWAIT);
 		if(slen < 0) goto fail;
 		slen = recv(sock, buf, len, MSG_WAITALL);
@@ -224,10 +223,9 @@ long tcp_ping(int sock, size_t len, int n) {
 		if((size_t)slen < len) {
 			fprintf(stderr, "received less bytes than sent (%ld < %ld)\n", slen, len);
 		}
+		hist_record(&hist, (long)(time_ns() - t_ping));
 	}
-	gettimeofday(&t2, NULL);
-	timersub(&t2, &t1, &t_delta);
-	ret = t_delta.tv_usec + t_delta.tv_sec * 1000L*1000L;
+	ret = (long)(time_ns() - t1);
 
 	free(buf); 
 	return ret/n;
@@ -249,12 +247,13 @@ static void tcp_tests(const struct sockaddr_in *remote) {
         exit(EXIT_FAILURE); 
     }
 
+	char strbuf[32];
 	long rtt = tcp_connect(sock, (const struct sockaddr*)remote);
 	if(rtt < 0) {
     	fprintf(stderr, "Connect failed: %s\n", strerror(errno));
         exit(EXIT_FAILURE); 
 	} else {
-		printf("; Connect\t%ld µsec\n", rtt);
+		printf("; Connect\t%s\n", str_ns(strbuf, sizeof(strbuf), rtt));
 	}
 
 	// Disable Nagle's algorithm for ping 
@@ -266,15 +265,16 @@ static void tcp_tests(const struct sockaddr_in *remote) {
 		printf("# TCP_NODELAY = 1\n");
 	}
 
-	printf("# Size	Average	Best	Worst\n");
+	print_header();
 
 	for(size_t i=0;i<(sizeof(bytes)/sizeof(bytes[0]));i++) {
-		long rtt[SERIES];
-		for(int j=0;j<SERIES;j++) {
-			rtt[j] = tcp_ping(sock, bytes[i], iterations);
-		}
+		hist_reset(&hist);
+		bool failed = false;
+		for(int j=0;j<SERIES && !failed;j++)
+			failed = tcp_ping(sock, bytes[i], iterations) < 0;
 
-		printf("%ld\t%.0f\t%ld\t%ld\n", bytes[i], a_avg(rtt, SERIES), a_min(rtt, SERIES), a_max(rtt, SERIES));
+		if(failed || hist.count == 0) printf("%ld\terr\n", bytes[i]);
+		else print_row(bytes[i], &hist);
 
 
 	}
@@ -26,10 +26,12 @@
 #include <sys/types.h>
 #include <netdb.h> 
 #include <sys/time.h>
+#include "timing.h"
 #include <netinet/tcp.h>
 
 /**
   * Pings n times on the given socket with the given len
+  * @returns total time in ns or -1 on error
   */
 long ping(int sock, size_t len, int n) {
 	char *buf = (char*)malloc(sizeof(char)*len);
@@ -38,8 +40,7 @@ long ping(int sock, size_t len, int n) {
 
 	memset(buf, 'a', len);
 
-	struct timeval t1, t2, t_delta;
-	gettimeofday(&t1, NULL);
+	const uint64_t t1 = time_ns();
 	for(int i=0;i<n;i++) {
 		ssize_t slen = send(sock, buf, len, MSG_DONTWAIT);
 		if(slen < 0) goto fail;
@@ -49,9 +50,7 @@ long ping(int sock, size_t len, int n) {
 			fprintf(stderr, "received less bytes than sent (%ld < %ld)\n", slen, len);
 		}
 	}
-	gettimeofday(&t2, NULL);
-	timersub(&t2, &t1, &t_delta);
-	ret = t_delta.tv_usec + t_delta.tv_sec * 1000L*1000L;
+	ret = (long)(time_ns() - t1);
 
 	free(buf); 
 	return ret;
@@ -66,13 +65,18 @@ int main(int argc, char** argv) {
 	int port = 7;
 	int sock;
 
-	if(argc < 2) {
-		printf("Usage: %s REMOTE [PORT]\n", argv[0]);
+	bool tsc = false;
+	int positional = 0;
+	for(int i=1;i<argc;i++) {
+		if(!strcmp("--tsc", argv[i])) tsc = true;
+		else if(positional++ == 0) remote = argv[i];
+		else port = atoi(argv[i]);
+	}
+	if(positional < 1) {
+		printf("Usage: %s [--tsc] REMOTE [PORT]\n", argv[0]);
 		exit(EXIT_FAILURE);
 	}
-	remote = argv[1];
-	if(argc > 2)
-		port = atoi(argv[2]);
+	timing_init(tsc);
 
   
     // Creating socket file descriptor 
@@ -106,7 +110,8 @@ int main(int argc, char** argv) {
 	if(setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *)&one, sizeof(int)) < 0)
 		fprintf(stderr, "Warning: Failed to set TCP_NODELAY for new socket: %s\n", strerror(errno));
 
-    printf("   Bytes    RTT [usec]\n");
+    char strbuf[32];
+    printf("   Bytes         RTT\n");
     for(int i=0;i<15;i++) {
     	size_t bytes = pow(2,i);
 
@@ -116,7 +121,7 @@ int main(int argc, char** argv) {
 	    	if(rtt < 0) {
 	    		printf("err\n");
 	    	} else {
-	    		printf("%8ld\n", rtt/iterations);
+	    		printf("%12s\n", str_ns(strbuf, sizeof(strbuf), (double)rtt/iterations));
 	    	}
     	}
     }
@@ -26,15 +26,19 @@
 #include <sys/types.h>
 #include <netdb.h> 
 #include <sys/time.h>
+#include "timing.h"
+#include "hist.h"
 #include <netinet/tcp.h>
 
 // Number of runs per series
 #define SERIES 10
-#define DISABLE_NAGLE 0
 
 static char *remote = "";
 static int port = 7;
 static int iterations = 10;
+static bool tsc = false;
+static bool nodelay = false;	// Disable Nagle's algorithm
+static hist_t hist;				// Transfer times of the current size
 
 
 static void throughput_test(const struct sockaddr_in *remote);
@@ -58,6 +62,8 @@ int main(int argc, char** argv) {
 				printf("OPTIONS\n");
 				printf("  -h, --help                 Print this help message\n");
 				printf("  -i, --iterations N         Set number of iterations (default: 10)\n");
+				printf("  --tsc                      Use the calibrated TSC as clock source (x86 with invariant TSC)\n");
+				printf("  --nodelay                  Disable Nagle's algorithm (TCP_NODELAY)\n");
 				printf("REMOTE:PORT must be an endpoint with 'echo' running (tcp only!)\n");
 				printf("\n");
 				printf("https://github.com/grisu48/pingpong\n");
@@ -65,6 +71,10 @@ int main(int argc, char** argv) {
 			} else if(!strcmp("-i", arg) || !strcmp("--iterations", arg)) {
 				// XXX: Out of bound check
 				iterations = atoi(argv[++i]);
+			} else if(!strcmp("--tsc", arg)) {
+				tsc = true;
+			} else if(!strcmp("--nodelay", arg)) {
+				nodelay = true;
 			} else {
 				fprintf(stderr, "Illegal argument: %s\n", arg);
 				printf("Type %s --help if you need help\n", argv[0]);
@@ -78,6 +88,8 @@ int main(int argc, char** argv) {
 		}
 	}
   
+    timing_init(tsc);
+
     struct sockaddr_in addr; 
     memset(&addr, 0, sizeof(addr)); 
     addr.sin_family = AF_INET; 
@@ -89,49 +101,18 @@ int main(int argc, char** argv) {
     exit(EXIT_SUCCESS);
 }
 
-static long a_max(const long* arr, const size_t n) {
-	long ret = arr[0];
-	for(size_t i=0;i<n;i++) {
-		if(arr[i] < 0) continue;
-		if(arr[i] > ret) ret = arr[i];
-	}
-	return ret;
-}
-
-static long a_min(const long* arr, const size_t n) {
-	long ret = a_max(arr,n);		// Make sure we don't take -1 by accident!
-	for(size_t i=0;i<n;i++) {
-		if(arr[i] < 0) continue;
-		if(arr[i] < ret) ret = arr[i];
-	}
-	return ret;
-}
-
-static double a_avg(const long* arr, const size_t n) {
-	double sum = 0;
-	long elems = 0;
-	for(size_t i=0;i<n;i++) {
-		if(arr[i] < 0) continue;
-		sum += arr[i];
-		elems++;
-	}
-	return sum/(double)elems;
-}
-
-
-
 long tcp_connect(int sock, const struct sockaddr *remote) {
 	socklen_t addrlen = sizeof(struct sockaddr);
 
-	struct timeval t1, t2, t_delta;
-	gettimeofday(&t1, NULL);
+	const uint64_t t1 = time_ns();
 	int rc = connect(sock, (const struct sockaddr *)remote, addrlen);
-	gettimeofday(&t2, NULL);
+	const uint64_t t2 = time_ns();
 	if(rc < 0) return -1;
-	timersub(&t2, &t1, &t_delta);
-	return (t_delta.tv_usec + t_delta.tv_sec * 1000L*1000L);
+	return (long)(t2 - t1);
 }
 
+/** Send and receive len bytes n times and record the time of every transfer in hist
+  * @returns average time per transfer in ns or -1 on error */
 long tcp_sendrecv(const int sock, const size_t len, const int n, const size_t buf_len) {
 	char *buf = (char*)malloc(sizeof(char)*buf_len);
 	if(buf == NULL) return -1;
@@ -140,9 +121,9 @@ long tcp_sendrecv(const int sock, const size_t len, const int n, const size_t bu
 	// XXX Randomize data?
 	memset(buf, 'a', buf_len);
 
-	struct timeval t1, t2, t_delta;
-	gettimeofday(&t1, NULL);
+	const uint64_t t1 = time_ns();
 	for(int i=0;i<n;i++) {
+		const uint64_t t_transfer = time_ns();
 		size_t remaining = len;
 
 		while(remaining > 0) {
@@ -153,11 +134,9 @@ long tcp_sendrecv(const int sock, const size_t len, const int n, const size_t bu
 			if(slen < 0) goto fail;
 			remaining -= b;
 		}
-
+		hist_record(&hist, (long)(time_ns() - t_transfer));
 	}
-	gettimeofday(&t2, NULL);
-	timersub(&t2, &t1, &t_delta);
-	ret = t_delta.tv_usec + t_delta.tv_sec * 1000L*1000L;
+	ret = (long)(time_ns() - t1);
 
 	free(buf); 
 	return ret/n;
@@ -180,43 +159,49 @@ static void throughput_test(const struct sockaddr_in *remote) {
         exit(EXIT_FAILURE); 
     }
 
+	char strbuf[32];
 	long rtt = tcp_connect(sock, (const struct sockaddr*)remote);
 	if(rtt < 0) {
     	fprintf(stderr, "Connect failed: %s\n", strerror(errno));
         exit(EXIT_FAILURE); 
 	} else {
-		printf("; Connect\t%ld µsec\n", rtt);
+		printf("; Connect\t%s\n", str_ns(strbuf, sizeof(strbuf), rtt));
 	}
 
-#if DISABLE_NAGLE == 1
-	// Disable Nagle's algorithm
-	int one = 1;
-	if(setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *)&one, sizeof(int)) < 0) {
-		fprintf(stderr, "Failed to set TCP_NODELAY for new socket: %s\n", strerror(errno));
-		goto finish;
-	} else {
-		printf("# TCP_NODELAY = 1\n");
+	if(nodelay) {
+		int one = 1;
+		if(setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *)&one, sizeof(int)) < 0) {
+			fprintf(stderr, "Failed to set TCP_NODELAY for new socket: %s\n", strerror(errno));
+			goto finish;
+		} else {
+			printf("# TCP_NODELAY = 1\n");
+		}
 	}
-#endif
 
-	printf("# Size\t%8s\t%8s\t%8s\n", "Average [MB/s]", "Worst [MB/s]", "Best [MB/s]");
+	// The slow tail of the transfer times is the low end of the throughput
+	printf("# Size\t%8s\t%8s\t%8s\t%8s\t%8s\t%8s\n", "Average [MB/s]", "Worst [MB/s]", "p99.9 [MB/s]", "p99 [MB/s]", "p50 [MB/s]", "Best [MB/s]");
 
 	for(size_t i=0;i<(sizeof(bytes)/sizeof(bytes[0]));i++) {
-		long rtt[SERIES];
 		const long size = bytes[i];
-		for(int j=0;j<SERIES;j++) {
-			rtt[j] = tcp_sendrecv(sock, size, iterations, buf_len);
+		hist_reset(&hist);
+		bool failed = false;
+		for(int j=0;j<SERIES && !failed;j++)
+			failed = tcp_sendrecv(sock, size, iterations, buf_len) < 0;
+		// An incomplete series would look like a complete row, an empty one divides by zero
+		if(failed || hist.count == 0) {
+			printf("%ld\terr\n", size);
+			continue;
 		}
 
-		long t_avg = a_avg(rtt, SERIES);
-		long t_min = a_min(rtt, SERIES);
-		long t_max = a_max(rtt, SERIES);
-
-		double s_avg = size/(t_avg*1e-6)/(1024.0*1024.0);
-		double s_min = size/(t_max*1e-6)/(1024.0*1024.0);
-		double s_max = size/(t_min*1e-6)/(1024.0*1024.0);
+		const double mb = size/(1024.0*1024.0);
+		double s_avg = mb/(hist_avg(&hist)*1e-9);
+		double s_min = mb/(hist.max*1e-9);
+		double s_p999 = mb/(hist_percentile(&hist, 99.9)*1e-9);
+		double s_p99 = mb/(hist_percentile(&hist, 99)*1e-9);
+		double s_p50 = mb/(hist_percentile(&hist, 50)*1e-9);
+		double s_max = mb/(hist.min*1e-9);
 
-		printf("%ld\t%8.2f\t%8.2f\t%8.2f\n", bytes[i], s_avg, s_min, s_max);
+		printf("%ld\t%8.2f\t%8.2f\t%8.2f\t%8.2f\t%8.2f\t%8.2f\n", bytes[i], s_avg, s_min, s_p999, s_p99, s_p50, s_max);
 
 
 	}
@@ -225,8 +210,6 @@ static void throughput_test(const struct sockaddr_in *remote) {
 
 
 
-#if DISABLE_NAGLE == 1
 finish:
 	close(sock);
-#endif
 }
@@ -0,0 +1,103 @@
+/* =============================================================================
+ *
+ * Title:         Common timing layer for the pingpong tools
+ * Author:        Felix Niederwanger
+ * License:       Copyright (c), 2019 Felix Niederwanger
+ *                MIT license (http://opensource.org/licenses/MIT)
+ *
+ * All measurements are taken in nanoseconds on CLOCK_MONOTONIC_RAW, which
+ * is neither stepped nor slewed by NTP. On x86 with an invariant TSC the
+ * clock can optionally be read with rdtscp, calibrated once against
+ * CLOCK_MONOTONIC_RAW (timing_init).
+ *
+ * =============================================================================
+ */
+
+#ifndef _PINGPONG_TIMING_H_
+#define _PINGPONG_TIMING_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#include <cpuid.h>
+#define TIMING_HAVE_TSC 1
+#endif
+
+#define TIMING_CALIBRATION_NS 50000000L		// Duration of the TSC calibration
+
+static bool timing_tsc = false;				// Use the TSC instead of clock_gettime
+#ifdef TIMING_HAVE_TSC
+static uint64_t tsc_base_cycles = 0;		// TSC at calibration time
+static uint64_t tsc_base_ns = 0;			// CLOCK_MONOTONIC_RAW at calibration time
+static uint64_t tsc_mult = 0;				// ns = cycles * tsc_mult >> 32
+#endif
+
+/** Current time on CLOCK_MONOTONIC_RAW in ns */
+static inline uint64_t clock_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000UL + (uint64_t)ts.tv_nsec;
+}
+
+/** Current monotonic time in ns, from the TSC if enabled with timing_init */
+static inline uint64_t time_ns(void) {
+#ifdef TIMING_HAVE_TSC
+	if(timing_tsc) {
+		unsigned int aux;
+		const uint64_t cycles = __rdtscp(&aux) - tsc_base_cycles;
+		return tsc_base_ns + (uint64_t)(((unsigned __int128)cycles * tsc_mult) >> 32);
+	}
+#endif
+	return clock_ns();
+}
+
+/** Initialize the timing layer
+  * @param tsc Try to use the TSC. Requires an invariant TSC, otherwise we stay on clock_gettime
+  * @returns 0 on success, -1 if the TSC has been requested but cannot be used */
+static inline int timing_init(const bool tsc) {
+	timing_tsc = false;
+	if(!tsc) return 0;
+#ifdef TIMING_HAVE_TSC
+	unsigned int eax, ebx, ecx, edx;
+	// CPUID 0x80000007, EDX bit 8: Invariant TSC (constant rate in all P-, C- and T-states)
+	if(!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1u << 8))) {
+		fprintf(stderr, "Warning: No invariant TSC, using CLOCK_MONOTONIC_RAW\n");
+		return -1;
+	}
+	unsigned int aux;
+	const uint64_t ns0 = clock_ns();
+	const uint64_t c0 = __rdtscp(&aux);
+	uint64_t ns1;
+	do {
+		ns1 = clock_ns();
+	} while(ns1 - ns0 < (uint64_t)TIMING_CALIBRATION_NS);
+	const uint64_t c1 = __rdtscp(&aux);
+	if(c1 <= c0) {
+		fprintf(stderr, "Warning: TSC calibration failed, using CLOCK_MONOTONIC_RAW\n");
+		return -1;
+	}
+	tsc_mult = (uint64_t)((((unsigned __int128)(ns1 - ns0)) << 32) / (c1 - c0));
+	tsc_base_cycles = c1;
+	tsc_base_ns = ns1;
+	timing_tsc = true;
+	return 0;
+#else
+	fprintf(stderr, "Warning: No TSC on this architecture, using CLOCK_MONOTONIC_RAW\n");
+	return -1;
+#endif
+}
+
+/** Format a duration in ns with a suitable unit (ns, µs, ms or s) */
+static inline char* str_ns(char* buf, const size_t size, const double ns) {
+	if(ns < 1e3) snprintf(buf, size, "%.0f ns", ns);
+	else if(ns < 1e6) snprintf(buf, size, "%.2f µs", ns*1e-3);
+	else if(ns < 1e9) snprintf(buf, size, "%.2f ms", ns*1e-6);
+	else snprintf(buf, size, "%.2f s", ns*1e-9);
+	return buf;
+}
+
+#endif